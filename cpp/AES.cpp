@@ -17,19 +17,93 @@ AES::AES(const AESKeyLength keyLength) {
       this->Nr = 14;
       break;
   }
+  this->backend = AESBACKEND::BestBackend();
 }
 
-unsigned char *AES::EncryptECB(const unsigned char in[], unsigned int inLen,
-                               const unsigned char key[]) {
+void AES::SetBackend(const AESBackend _backend) {
+  if (!AESBACKEND::IsSupported(_backend)) {
+    throw std::invalid_argument(std::string("AES backend is not supported: ") +
+                                AESBACKEND::BackendName(_backend));
+  }
+  backend = _backend;
+  if (hasKey) {
+    AESBACKEND::PrepareKeySchedule(backend, keySchedule);
+  }
+}
+
+AESBackend AES::GetBackend() const { return backend; }
+
+void AES::SetKey(const unsigned char key[]) {
+  ExpandKey(key, keySchedule);
+  hasKey = true;
+}
+
+void AES::SetKey(const std::vector<unsigned char> &key) {
+  if (key.size() != 4 * Nk) {
+    throw std::length_error("Key length must be " + std::to_string(4 * Nk));
+  }
+  SetKey(key.data());
+}
+
+bool AES::HasKey() const { return hasKey; }
+
+void AES::EncryptBlocks(const unsigned char in[], unsigned int inLen,
+                        unsigned char out[]) {
+  if (!hasKey) {
+    throw std::logic_error("SetKey must be called before EncryptBlocks");
+  }
   CheckLength(inLen);
-  unsigned char *out = new unsigned char[inLen];
-  unsigned char *roundKeys = new unsigned char[4 * Nb * (Nr + 1)];
-  KeyExpansion(key, roundKeys);
+  EncryptBlocks(keySchedule, in, inLen, out);
+}
+
+void AES::DecryptBlocks(const unsigned char in[], unsigned int inLen,
+                        unsigned char out[]) {
+  if (!hasKey) {
+    throw std::logic_error("SetKey must be called before DecryptBlocks");
+  }
+  CheckLength(inLen);
+  DecryptBlocks(keySchedule, in, inLen, out);
+}
+
+void AES::ExpandKey(const unsigned char key[], AESBACKEND::KeySchedule &ks) {
+  KeyExpansion(key, ks.enc);
+  ks.Nr = Nr;
+  AESBACKEND::PrepareKeySchedule(backend, ks);
+}
+
+void AES::EncryptBlocks(const AESBACKEND::KeySchedule &ks,
+                        const unsigned char in[], unsigned int inLen,
+                        unsigned char out[]) {
+  if (backend != AESBackend::REFERENCE) {
+    AESBACKEND::EncryptBlocks(backend, ks, in, inLen, out);
+    return;
+  }
+  unsigned char *roundKeys = const_cast<unsigned char *>(ks.enc);
   for (unsigned int i = 0; i < inLen; i += blockBytesLen) {
     EncryptBlock(in + i, out + i, roundKeys);
   }
+}
 
-  delete[] roundKeys;
+void AES::DecryptBlocks(const AESBACKEND::KeySchedule &ks,
+                        const unsigned char in[], unsigned int inLen,
+                        unsigned char out[]) {
+  if (backend != AESBackend::REFERENCE) {
+    AESBACKEND::DecryptBlocks(backend, ks, in, inLen, out);
+    return;
+  }
+  unsigned char *roundKeys = const_cast<unsigned char *>(ks.enc);
+  for (unsigned int i = 0; i < inLen; i += blockBytesLen) {
+    DecryptBlock(in + i, out + i, roundKeys);
+  }
+}
+
+unsigned char *AES::EncryptECB(const unsigned char in[], unsigned int inLen,
+                               const unsigned char key[]) {
+  CheckLength(inLen);
+  unsigned char *out = new unsigned char[inLen];
+  AESBACKEND::KeySchedule ks;
+  ExpandKey(key, ks);
+  EncryptBlocks(ks, in, inLen, out);
 
   return out;
 }
@@ -38,13 +112,9 @@ unsigned char *AES::DecryptECB(const unsigned char in[], unsigned int inLen,
                                const unsigned char key[]) {
   CheckLength(inLen);
   unsigned char *out = new unsigned char[inLen];
-  unsigned char *roundKeys = new unsigned char[4 * Nb * (Nr + 1)];
-  KeyExpansion(key, roundKeys);
-  for (unsigned int i = 0; i < inLen; i += blockBytesLen) {
-    DecryptBlock(in + i, out + i, roundKeys);
-  }
-
-  delete[] roundKeys;
+  AESBACKEND::KeySchedule ks;
+  ExpandKey(key, ks);
+  DecryptBlocks(ks, in, inLen, out);
 
   return out;
 }
@@ -55,17 +125,15 @@ unsigned char *AES::EncryptCBC(const unsigned char in[], unsigned int inLen,
   CheckLength(inLen);
   unsigned char *out = new unsigned char[inLen];
   unsigned char block[blockBytesLen];
-  unsigned char *roundKeys = new unsigned char[4 * Nb * (Nr + 1)];
-  KeyExpansion(key, roundKeys);
+  AESBACKEND::KeySchedule ks;
+  ExpandKey(key, ks);
   memcpy(block, iv, blockBytesLen);
   for (unsigned int i = 0; i < inLen; i += blockBytesLen) {
     XorBlocks(block, in + i, block, blockBytesLen);
-    EncryptBlock(block, out + i, roundKeys);
+    EncryptBlocks(ks, block, blockBytesLen, out + i);
     memcpy(block, out + i, blockBytesLen);
   }
 
-  delete[] roundKeys;
-
   return out;
 }
 
@@ -75,17 +143,15 @@ unsigned char *AES::DecryptCBC(const unsigned char in[], unsigned int inLen,
   CheckLength(inLen);
   unsigned char *out = new unsigned char[inLen];
   unsigned char block[blockBytesLen];
-  unsigned char *roundKeys = new unsigned char[4 * Nb * (Nr + 1)];
-  KeyExpansion(key, roundKeys);
+  AESBACKEND::KeySchedule ks;
+  ExpandKey(key, ks);
   memcpy(block, iv, blockBytesLen);
   for (unsigned int i = 0; i < inLen; i += blockBytesLen) {
-    DecryptBlock(in + i, out + i, roundKeys);
+    DecryptBlocks(ks, in + i, blockBytesLen, out + i);
     XorBlocks(block, out + i, out + i, blockBytesLen);
     memcpy(block, in + i, blockBytesLen);
   }
 
-  delete[] roundKeys;
-
   return out;
 }
 
@@ -96,17 +162,15 @@ unsigned char *AES::EncryptCFB(const unsigned char in[], unsigned int inLen,
   unsigned char *out = new unsigned char[inLen];
   unsigned char block[blockBytesLen];
   unsigned char encryptedBlock[blockBytesLen];
-  unsigned char *roundKeys = new unsigned char[4 * Nb * (Nr + 1)];
-  KeyExpansion(key, roundKeys);
+  AESBACKEND::KeySchedule ks;
+  ExpandKey(key, ks);
   memcpy(block, iv, blockBytesLen);
   for (unsigned int i = 0; i < inLen; i += blockBytesLen) {
-    EncryptBlock(block, encryptedBlock, roundKeys);
+    EncryptBlocks(ks, block, blockBytesLen, encryptedBlock);
     XorBlocks(in + i, encryptedBlock, out + i, blockBytesLen);
     memcpy(block, out + i, blockBytesLen);
   }
 
-  delete[] roundKeys;
-
   return out;
 }
 
@@ -117,17 +181,15 @@ unsigned char *AES::DecryptCFB(const unsigned char in[], unsigned int inLen,
   unsigned char *out = new unsigned char[inLen];
   unsigned char block[blockBytesLen];
   unsigned char encryptedBlock[blockBytesLen];
-  unsigned char *roundKeys = new unsigned char[4 * Nb * (Nr + 1)];
-  KeyExpansion(key, roundKeys);
+  AESBACKEND::KeySchedule ks;
+  ExpandKey(key, ks);
   memcpy(block, iv, blockBytesLen);
   for (unsigned int i = 0; i < inLen; i += blockBytesLen) {
-    EncryptBlock(block, encryptedBlock, roundKeys);
+    EncryptBlocks(ks, block, blockBytesLen, encryptedBlock);
     XorBlocks(in + i, encryptedBlock, out + i, blockBytesLen);
     memcpy(block, in + i, blockBytesLen);
   }
 
-  delete[] roundKeys;
-
   return out;
 }
 
@@ -10,6 +10,8 @@
 #include <string>
 #include <vector>
 
+#include "AESBackend.h"
+
 enum class AESKeyLength { AES_128, AES_192, AES_256 };
 
 class AES {
@@ -20,6 +22,12 @@ class AES {
   unsigned int Nk;
   unsigned int Nr;
 
+  AESBackend backend;
+
+  // round keys expanded once by SetKey
+  AESBACKEND::KeySchedule keySchedule;
+  bool hasKey = false;
+
   void SubBytes(unsigned char state[4][Nb]);
 
   void ShiftRow(unsigned char state[4][Nb], unsigned int i,
@@ -60,13 +68,41 @@ class AES {
   void XorBlocks(const unsigned char *a, const unsigned char *b,
                  unsigned char *c, unsigned int len);
 
+  void ExpandKey(const unsigned char key[], AESBACKEND::KeySchedule &ks);
+
+  void EncryptBlocks(const AESBACKEND::KeySchedule &ks, const unsigned char in[],
+                     unsigned int inLen, unsigned char out[]);
+
+  void DecryptBlocks(const AESBACKEND::KeySchedule &ks, const unsigned char in[],
+                     unsigned int inLen, unsigned char out[]);
+
   std::vector<unsigned char> ArrayToVector(unsigned char *a, unsigned int len);
 
   unsigned char *VectorToArray(std::vector<unsigned char> &a);
 
  public:
+  // the backend defaults to the fastest one supported by the cpu
   explicit AES(const AESKeyLength keyLength = AESKeyLength::AES_256);
 
+  void SetBackend(const AESBackend _backend);
+
+  AESBackend GetBackend() const;
+
+  // Expands the key once, so that EncryptBlocks/DecryptBlocks can process
+  // any number of blocks without re-running KeyExpansion or allocating.
+  void SetKey(const unsigned char key[]);
+
+  void SetKey(const std::vector<unsigned char> &key);
+
+  bool HasKey() const;
+
+  // ECB mode with the key given to SetKey, out must hold inLen bytes
+  void EncryptBlocks(const unsigned char in[], unsigned int inLen,
+                     unsigned char out[]);
+
+  void DecryptBlocks(const unsigned char in[], unsigned int inLen,
+                     unsigned char out[]);
+
   unsigned char *EncryptECB(const unsigned char in[], unsigned int inLen,
                             const unsigned char key[]);
 
@@ -0,0 +1,373 @@
+#include "AESBackend.h"
+
+#include <cstring>
+#include <stdexcept>
+
+#include "AES.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <wmmintrin.h>
+#define AES_BACKEND_X86
+#endif
+
+namespace AESBACKEND {
+
+namespace {
+
+inline unsigned char SBox(unsigned char x) { return sbox[x >> 4][x & 15]; }
+
+inline unsigned char InvSBox(unsigned char x) {
+  return inv_sbox[x >> 4][x & 15];
+}
+
+inline uint32_t GetU32(const unsigned char *p) {
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+         ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+inline void PutU32(unsigned char *p, uint32_t v) {
+  p[0] = (unsigned char)(v >> 24);
+  p[1] = (unsigned char)(v >> 16);
+  p[2] = (unsigned char)(v >> 8);
+  p[3] = (unsigned char)v;
+}
+
+inline uint32_t Ror8(uint32_t v) { return (v >> 8) | (v << 24); }
+
+// T-tables built from the sbox and GF_MUL_TABLE of AES.h
+struct TTables {
+  uint32_t Te[4][256];
+  uint32_t Td[4][256];
+
+  TTables() {
+    for (unsigned int x = 0; x < 256; ++x) {
+      unsigned char s = SBox(x);
+      unsigned char is = InvSBox(x);
+      Te[0][x] = ((uint32_t)GF_MUL_TABLE[2][s] << 24) | ((uint32_t)s << 16) |
+                 ((uint32_t)s << 8) | (uint32_t)GF_MUL_TABLE[3][s];
+      Td[0][x] = ((uint32_t)GF_MUL_TABLE[14][is] << 24) |
+                 ((uint32_t)GF_MUL_TABLE[9][is] << 16) |
+                 ((uint32_t)GF_MUL_TABLE[13][is] << 8) |
+                 (uint32_t)GF_MUL_TABLE[11][is];
+      for (int t = 1; t < 4; ++t) {
+        Te[t][x] = Ror8(Te[t - 1][x]);
+        Td[t][x] = Ror8(Td[t - 1][x]);
+      }
+    }
+  }
+};
+
+const TTables &GetTTables() {
+  static const TTables tables;
+  return tables;
+}
+
+void TTableEncryptBlock(const TTables &T, const uint32_t *rk, unsigned int Nr,
+                        const unsigned char in[], unsigned char out[]) {
+  uint32_t s0 = GetU32(in) ^ rk[0];
+  uint32_t s1 = GetU32(in + 4) ^ rk[1];
+  uint32_t s2 = GetU32(in + 8) ^ rk[2];
+  uint32_t s3 = GetU32(in + 12) ^ rk[3];
+  uint32_t t0, t1, t2, t3;
+
+  for (unsigned int round = 1; round < Nr; ++round) {
+    rk += 4;
+    t0 = T.Te[0][s0 >> 24] ^ T.Te[1][(s1 >> 16) & 0xff] ^
+         T.Te[2][(s2 >> 8) & 0xff] ^ T.Te[3][s3 & 0xff] ^ rk[0];
+    t1 = T.Te[0][s1 >> 24] ^ T.Te[1][(s2 >> 16) & 0xff] ^
+         T.Te[2][(s3 >> 8) & 0xff] ^ T.Te[3][s0 & 0xff] ^ rk[1];
+    t2 = T.Te[0][s2 >> 24] ^ T.Te[1][(s3 >> 16) & 0xff] ^
+         T.Te[2][(s0 >> 8) & 0xff] ^ T.Te[3][s1 & 0xff] ^ rk[2];
+    t3 = T.Te[0][s3 >> 24] ^ T.Te[1][(s0 >> 16) & 0xff] ^
+         T.Te[2][(s1 >> 8) & 0xff] ^ T.Te[3][s2 & 0xff] ^ rk[3];
+    s0 = t0;
+    s1 = t1;
+    s2 = t2;
+    s3 = t3;
+  }
+
+  // last round has no MixColumns
+  rk += 4;
+  t0 = ((uint32_t)SBox(s0 >> 24) << 24) ^ ((uint32_t)SBox(s1 >> 16) << 16) ^
+       ((uint32_t)SBox(s2 >> 8) << 8) ^ (uint32_t)SBox(s3) ^ rk[0];
+  t1 = ((uint32_t)SBox(s1 >> 24) << 24) ^ ((uint32_t)SBox(s2 >> 16) << 16) ^
+       ((uint32_t)SBox(s3 >> 8) << 8) ^ (uint32_t)SBox(s0) ^ rk[1];
+  t2 = ((uint32_t)SBox(s2 >> 24) << 24) ^ ((uint32_t)SBox(s3 >> 16) << 16) ^
+       ((uint32_t)SBox(s0 >> 8) << 8) ^ (uint32_t)SBox(s1) ^ rk[2];
+  t3 = ((uint32_t)SBox(s3 >> 24) << 24) ^ ((uint32_t)SBox(s0 >> 16) << 16) ^
+       ((uint32_t)SBox(s1 >> 8) << 8) ^ (uint32_t)SBox(s2) ^ rk[3];
+  PutU32(out, t0);
+  PutU32(out + 4, t1);
+  PutU32(out + 8, t2);
+  PutU32(out + 12, t3);
+}
+
+void TTableDecryptBlock(const TTables &T, const uint32_t *dk, unsigned int Nr,
+                        const unsigned char in[], unsigned char out[]) {
+  uint32_t s0 = GetU32(in) ^ dk[0];
+  uint32_t s1 = GetU32(in + 4) ^ dk[1];
+  uint32_t s2 = GetU32(in + 8) ^ dk[2];
+  uint32_t s3 = GetU32(in + 12) ^ dk[3];
+  uint32_t t0, t1, t2, t3;
+
+  for (unsigned int round = 1; round < Nr; ++round) {
+    dk += 4;
+    t0 = T.Td[0][s0 >> 24] ^ T.Td[1][(s3 >> 16) & 0xff] ^
+         T.Td[2][(s2 >> 8) & 0xff] ^ T.Td[3][s1 & 0xff] ^ dk[0];
+    t1 = T.Td[0][s1 >> 24] ^ T.Td[1][(s0 >> 16) & 0xff] ^
+         T.Td[2][(s3 >> 8) & 0xff] ^ T.Td[3][s2 & 0xff] ^ dk[1];
+    t2 = T.Td[0][s2 >> 24] ^ T.Td[1][(s1 >> 16) & 0xff] ^
+         T.Td[2][(s0 >> 8) & 0xff] ^ T.Td[3][s3 & 0xff] ^ dk[2];
+    t3 = T.Td[0][s3 >> 24] ^ T.Td[1][(s2 >> 16) & 0xff] ^
+         T.Td[2][(s1 >> 8) & 0xff] ^ T.Td[3][s0 & 0xff] ^ dk[3];
+    s0 = t0;
+    s1 = t1;
+    s2 = t2;
+    s3 = t3;
+  }
+
+  // last round has no InvMixColumns
+  dk += 4;
+  t0 = ((uint32_t)InvSBox(s0 >> 24) << 24) ^
+       ((uint32_t)InvSBox(s3 >> 16) << 16) ^
+       ((uint32_t)InvSBox(s2 >> 8) << 8) ^ (uint32_t)InvSBox(s1) ^ dk[0];
+  t1 = ((uint32_t)InvSBox(s1 >> 24) << 24) ^
+       ((uint32_t)InvSBox(s0 >> 16) << 16) ^
+       ((uint32_t)InvSBox(s3 >> 8) << 8) ^ (uint32_t)InvSBox(s2) ^ dk[1];
+  t2 = ((uint32_t)InvSBox(s2 >> 24) << 24) ^
+       ((uint32_t)InvSBox(s1 >> 16) << 16) ^
+       ((uint32_t)InvSBox(s0 >> 8) << 8) ^ (uint32_t)InvSBox(s3) ^ dk[2];
+  t3 = ((uint32_t)InvSBox(s3 >> 24) << 24) ^
+       ((uint32_t)InvSBox(s2 >> 16) << 16) ^
+       ((uint32_t)InvSBox(s1 >> 8) << 8) ^ (uint32_t)InvSBox(s0) ^ dk[3];
+  PutU32(out, t0);
+  PutU32(out + 4, t1);
+  PutU32(out + 8, t2);
+  PutU32(out + 12, t3);
+}
+
+void TTablePrepare(KeySchedule &ks) {
+  const TTables &T = GetTTables();
+  const unsigned int Nr = ks.Nr;
+  const unsigned int nWords = 4 * (Nr + 1);
+
+  for (unsigned int i = 0; i < nWords; ++i) {
+    ks.encWords[i] = GetU32(ks.enc + 4 * i);
+  }
+
+  // equivalent inverse cipher: reversed round keys, InvMixColumns applied
+  // to all but the first and the last one
+  for (unsigned int round = 0; round <= Nr; ++round) {
+    for (unsigned int j = 0; j < 4; ++j) {
+      uint32_t w = ks.encWords[4 * (Nr - round) + j];
+      if (round != 0 && round != Nr) {
+        w = T.Td[0][SBox(w >> 24)] ^ T.Td[1][SBox((w >> 16) & 0xff)] ^
+            T.Td[2][SBox((w >> 8) & 0xff)] ^ T.Td[3][SBox(w & 0xff)];
+      }
+      ks.decWords[4 * round + j] = w;
+    }
+  }
+}
+
+#ifdef AES_BACKEND_X86
+
+// number of blocks interleaved per iteration, the aesenc latency is hidden
+// behind independent blocks
+constexpr unsigned int AESNI_LANES = 4;
+
+__attribute__((target("aes,sse2"))) void AESNIPrepare(KeySchedule &ks) {
+  const unsigned int Nr = ks.Nr;
+  const __m128i *ek = reinterpret_cast<const __m128i *>(ks.enc);
+  __m128i *dk = reinterpret_cast<__m128i *>(ks.dec);
+
+  _mm_store_si128(dk, _mm_load_si128(ek + Nr));
+  for (unsigned int round = 1; round < Nr; ++round) {
+    _mm_store_si128(dk + round, _mm_aesimc_si128(_mm_load_si128(ek + Nr - round)));
+  }
+  _mm_store_si128(dk + Nr, _mm_load_si128(ek));
+}
+
+__attribute__((target("aes,sse2"))) void AESNIEncryptBlocks(
+    const KeySchedule &ks, const unsigned char in[], unsigned int inLen,
+    unsigned char out[]) {
+  const unsigned int Nr = ks.Nr;
+  const __m128i *rk = reinterpret_cast<const __m128i *>(ks.enc);
+  const unsigned int nBlocks = inLen / 16;
+  const __m128i *src = reinterpret_cast<const __m128i *>(in);
+  __m128i *des = reinterpret_cast<__m128i *>(out);
+  unsigned int i = 0;
+
+  for (; i + AESNI_LANES <= nBlocks; i += AESNI_LANES) {
+    __m128i b[AESNI_LANES];
+    __m128i k = _mm_load_si128(rk);
+    for (unsigned int j = 0; j < AESNI_LANES; ++j) {
+      b[j] = _mm_xor_si128(_mm_loadu_si128(src + i + j), k);
+    }
+    for (unsigned int round = 1; round < Nr; ++round) {
+      k = _mm_load_si128(rk + round);
+      for (unsigned int j = 0; j < AESNI_LANES; ++j) {
+        b[j] = _mm_aesenc_si128(b[j], k);
+      }
+    }
+    k = _mm_load_si128(rk + Nr);
+    for (unsigned int j = 0; j < AESNI_LANES; ++j) {
+      _mm_storeu_si128(des + i + j, _mm_aesenclast_si128(b[j], k));
+    }
+  }
+
+  for (; i < nBlocks; ++i) {
+    __m128i b = _mm_xor_si128(_mm_loadu_si128(src + i), _mm_load_si128(rk));
+    for (unsigned int round = 1; round < Nr; ++round) {
+      b = _mm_aesenc_si128(b, _mm_load_si128(rk + round));
+    }
+    _mm_storeu_si128(des + i, _mm_aesenclast_si128(b, _mm_load_si128(rk + Nr)));
+  }
+}
+
+__attribute__((target("aes,sse2"))) void AESNIDecryptBlocks(
+    const KeySchedule &ks, const unsigned char in[], unsigned int inLen,
+    unsigned char out[]) {
+  const unsigned int Nr = ks.Nr;
+  const __m128i *dk = reinterpret_cast<const __m128i *>(ks.dec);
+  const unsigned int nBlocks = inLen / 16;
+  const __m128i *src = reinterpret_cast<const __m128i *>(in);
+  __m128i *des = reinterpret_cast<__m128i *>(out);
+  unsigned int i = 0;
+
+  for (; i + AESNI_LANES <= nBlocks; i += AESNI_LANES) {
+    __m128i b[AESNI_LANES];
+    __m128i k = _mm_load_si128(dk);
+    for (unsigned int j = 0; j < AESNI_LANES; ++j) {
+      b[j] = _mm_xor_si128(_mm_loadu_si128(src + i + j), k);
+    }
+    for (unsigned int round = 1; round < Nr; ++round) {
+      k = _mm_load_si128(dk + round);
+      for (unsigned int j = 0; j < AESNI_LANES; ++j) {
+        b[j] = _mm_aesdec_si128(b[j], k);
+      }
+    }
+    k = _mm_load_si128(dk + Nr);
+    for (unsigned int j = 0; j < AESNI_LANES; ++j) {
+      _mm_storeu_si128(des + i + j, _mm_aesdeclast_si128(b[j], k));
+    }
+  }
+
+  for (; i < nBlocks; ++i) {
+    __m128i b = _mm_xor_si128(_mm_loadu_si128(src + i), _mm_load_si128(dk));
+    for (unsigned int round = 1; round < Nr; ++round) {
+      b = _mm_aesdec_si128(b, _mm_load_si128(dk + round));
+    }
+    _mm_storeu_si128(des + i, _mm_aesdeclast_si128(b, _mm_load_si128(dk + Nr)));
+  }
+}
+
+bool CpuHasAESNI() {
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+    return false;
+  }
+  return (ecx & bit_AES) != 0;
+}
+
+#endif  // AES_BACKEND_X86
+
+}  // namespace
+
+bool IsSupported(AESBackend backend) {
+  switch (backend) {
+    case AESBackend::REFERENCE:
+    case AESBackend::TTABLE:
+      return true;
+    case AESBackend::AESNI:
+#ifdef AES_BACKEND_X86
+    {
+      static const bool supported = CpuHasAESNI();
+      return supported;
+    }
+#else
+      return false;
+#endif
+  }
+  return false;
+}
+
+AESBackend BestBackend() {
+  if (IsSupported(AESBackend::AESNI)) {
+    return AESBackend::AESNI;
+  }
+  return AESBackend::TTABLE;
+}
+
+const char *BackendName(AESBackend backend) {
+  switch (backend) {
+    case AESBackend::REFERENCE:
+      return "reference";
+    case AESBackend::TTABLE:
+      return "t-table";
+    case AESBackend::AESNI:
+      return "aes-ni";
+  }
+  return "unknown";
+}
+
+void PrepareKeySchedule(AESBackend backend, KeySchedule &ks) {
+  switch (backend) {
+    case AESBackend::REFERENCE:
+      break;
+    case AESBackend::TTABLE:
+      TTablePrepare(ks);
+      break;
+    case AESBackend::AESNI:
+#ifdef AES_BACKEND_X86
+      AESNIPrepare(ks);
+      break;
+#else
+      throw std::invalid_argument("AES-NI backend is not available");
+#endif
+  }
+}
+
+void EncryptBlocks(AESBackend backend, const KeySchedule &ks,
+                   const unsigned char in[], unsigned int inLen,
+                   unsigned char out[]) {
+  switch (backend) {
+    case AESBackend::TTABLE: {
+      const TTables &T = GetTTables();
+      for (unsigned int i = 0; i < inLen; i += 16) {
+        TTableEncryptBlock(T, ks.encWords, ks.Nr, in + i, out + i);
+      }
+      break;
+    }
+    case AESBackend::AESNI:
+#ifdef AES_BACKEND_X86
+      AESNIEncryptBlocks(ks, in, inLen, out);
+      break;
+#endif
+    default:
+      throw std::invalid_argument("Unsupported AES backend");
+  }
+}
+
+void DecryptBlocks(AESBackend backend, const KeySchedule &ks,
+                   const unsigned char in[], unsigned int inLen,
+                   unsigned char out[]) {
+  switch (backend) {
+    case AESBackend::TTABLE: {
+      const TTables &T = GetTTables();
+      for (unsigned int i = 0; i < inLen; i += 16) {
+        TTableDecryptBlock(T, ks.decWords, ks.Nr, in + i, out + i);
+      }
+      break;
+    }
+    case AESBackend::AESNI:
+#ifdef AES_BACKEND_X86
+      AESNIDecryptBlocks(ks, in, inLen, out);
+      break;
+#endif
+    default:
+      throw std::invalid_argument("Unsupported AES backend");
+  }
+}
+
+}  // namespace AESBACKEND
@@ -0,0 +1,56 @@
+#ifndef _AES_BACKEND_H_
+#define _AES_BACKEND_H_
+
+#include <cstdint>
+
+// Block cipher implementations behind the AES class.
+//
+// REFERENCE is the byte-oriented code of AES.cpp, TTABLE combines
+// SubBytes/ShiftRows/MixColumns into 32-bit table lookups, and AESNI uses
+// the x86 AES instructions when the running cpu supports them.
+enum class AESBackend { REFERENCE, TTABLE, AESNI };
+
+namespace AESBACKEND {
+
+constexpr unsigned int MAX_ROUNDS = 14;
+constexpr unsigned int MAX_ROUND_KEYS_LEN = 16 * (MAX_ROUNDS + 1);
+
+// Round keys of one expanded key, in the layout of every backend
+struct KeySchedule {
+  unsigned int Nr = 0;
+
+  // FIPS-197 round keys, also the AES-NI encryption keys
+  alignas(16) unsigned char enc[MAX_ROUND_KEYS_LEN];
+
+  // AES-NI decryption keys: reversed, with InvMixColumns applied
+  alignas(16) unsigned char dec[MAX_ROUND_KEYS_LEN];
+
+  // T-table round keys as big-endian column words
+  uint32_t encWords[4 * (MAX_ROUNDS + 1)];
+  uint32_t decWords[4 * (MAX_ROUNDS + 1)];
+};
+
+// whether the backend can run on this cpu
+bool IsSupported(AESBackend backend);
+
+// the fastest backend supported by this cpu
+AESBackend BestBackend();
+
+const char *BackendName(AESBackend backend);
+
+// derive the backend round keys from ks.enc and ks.Nr
+void PrepareKeySchedule(AESBackend backend, KeySchedule &ks);
+
+// ECB over inLen bytes (a multiple of 16) with the TTABLE or AESNI backend,
+// independent blocks are interleaved to keep the pipeline busy
+void EncryptBlocks(AESBackend backend, const KeySchedule &ks,
+                   const unsigned char in[], unsigned int inLen,
+                   unsigned char out[]);
+
+void DecryptBlocks(AESBackend backend, const KeySchedule &ks,
+                   const unsigned char in[], unsigned int inLen,
+                   unsigned char out[]);
+
+}  // namespace AESBACKEND
+
+#endif  // _AES_BACKEND_H_
@@ -0,0 +1,56 @@
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "global.h"
+#include "grid.hpp"
+#include "points.hpp"
+
+using ICDE18::Record_t;
+using ICDE18::PointStore;
+
+// Convert a silo data file from the text format to the binary point file
+// that the silo maps with --data_format=binary.
+//
+// With --grid_k (or --points_per_cell) the points are written in the order of
+// the grid, so a silo built with the same K finds them already sorted.
+int main(int argc, char** argv) {
+    // Expect args: --input=../../data/data_01.txt --output=../../data/data_01.bin [--grid_k=0] [--points_per_cell=0]
+    std::string input = ICDE18::GetArgument(argc, argv, "--input", "");
+    std::string output = ICDE18::GetArgument(argc, argv, "--output", "");
+    const std::string usage = "--input=data.txt --output=data.bin [--grid_k=K] [--points_per_cell=N]";
+    size_t grid_k = ICDE18::GetSizeArgument(argc, argv, "--grid_k", 0, usage);
+    size_t points_per_cell = ICDE18::GetSizeArgument(argc, argv, "--points_per_cell", 0, usage);
+    if (input.empty() || output.empty()) {
+        printf("Usage: %s %s\n", argv[0], usage.c_str());
+        exit(-1);
+    }
+
+    auto startTime = std::chrono::steady_clock::now();
+
+    // step1. Parse the text file
+    std::vector<Record_t> records;
+    ICDE18::GetInputData(input, records);
+    auto points_ptr = std::make_shared<PointStore>(records);
+    records.clear();
+    records.shrink_to_fit();
+
+    // step2. Sort the points by grid id, the grid reorders the store in place
+    if (grid_k == 0 && points_per_cell != 0) {
+        grid_k = INDEX::ChooseGridK(points_ptr->size(), points_per_cell);
+    }
+    if (grid_k != 0) {
+        INDEX::GridIndex<> grid(points_ptr, grid_k);
+    }
+
+    // step3. Write the binary file
+    points_ptr->write_file(output, grid_k);
+
+    printf("Converted %zu points from %s to %s, grid_k = %zu, %.0f [ms]\n",
+            points_ptr->size(), input.c_str(), output.c_str(), grid_k, ICDE18::QueryLogger::GetElapsedTime(startTime));
+    fflush(stdout);
+
+    return 0;
+}
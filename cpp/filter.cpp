@@ -0,0 +1,232 @@
+#include "filter.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FILTER_X86
+#endif
+
+namespace FILTER {
+
+namespace {
+
+size_t ScalarFilterCircle(const float* xs, const float* ys, size_t n,
+                          float cx, float cy, float rad, uint32_t* idx) {
+    const float rad2 = rad * rad;
+    size_t ret = 0;
+
+    for (size_t i=0; i<n; ++i) {
+        float deltax = xs[i] - cx;
+        float deltay = ys[i] - cy;
+        // branch-free, the index is kept only if the point is inside
+        idx[ret] = i;
+        ret += (deltax*deltax + deltay*deltay <= rad2);
+    }
+
+    return ret;
+}
+
+size_t ScalarFilterBox(const float* xs, const float* ys, size_t n,
+                       float lo_x, float lo_y, float hi_x, float hi_y, uint32_t* idx) {
+    size_t ret = 0;
+
+    for (size_t i=0; i<n; ++i) {
+        idx[ret] = i;
+        ret += (lo_x<=xs[i]) & (xs[i]<=hi_x) & (lo_y<=ys[i]) & (ys[i]<=hi_y);
+    }
+
+    return ret;
+}
+
+#ifdef FILTER_X86
+
+// write the set bits of mask as indices base+bit
+inline size_t AppendMaskIndices(unsigned int mask, uint32_t base, uint32_t* idx) {
+    size_t ret = 0;
+    while (mask) {
+        idx[ret++] = base + __builtin_ctz(mask);
+        mask &= mask - 1;
+    }
+    return ret;
+}
+
+// a*a+b*b must not be contracted into an fma, which would round differently
+// from the scalar code, so this file is built with -ffp-contract=off
+__attribute__((target("avx2")))
+size_t Avx2FilterCircle(const float* xs, const float* ys, size_t n,
+                        float cx, float cy, float rad, uint32_t* idx) {
+    const __m256 vcx = _mm256_set1_ps(cx);
+    const __m256 vcy = _mm256_set1_ps(cy);
+    const __m256 vrad2 = _mm256_set1_ps(rad * rad);
+    size_t ret = 0, i = 0;
+
+    for (; i+8<=n; i+=8) {
+        __m256 deltax = _mm256_sub_ps(_mm256_loadu_ps(xs + i), vcx);
+        __m256 deltay = _mm256_sub_ps(_mm256_loadu_ps(ys + i), vcy);
+        __m256 dist = _mm256_add_ps(_mm256_mul_ps(deltax, deltax), _mm256_mul_ps(deltay, deltay));
+        unsigned int mask = _mm256_movemask_ps(_mm256_cmp_ps(dist, vrad2, _CMP_LE_OQ));
+        ret += AppendMaskIndices(mask, i, idx + ret);
+    }
+    for (size_t j=ScalarFilterCircle(xs + i, ys + i, n - i, cx, cy, rad, idx + ret); j>0; --j, ++ret) {
+        idx[ret] += i;
+    }
+
+    return ret;
+}
+
+__attribute__((target("avx2")))
+size_t Avx2FilterBox(const float* xs, const float* ys, size_t n,
+                     float lo_x, float lo_y, float hi_x, float hi_y, uint32_t* idx) {
+    const __m256 vlo_x = _mm256_set1_ps(lo_x), vhi_x = _mm256_set1_ps(hi_x);
+    const __m256 vlo_y = _mm256_set1_ps(lo_y), vhi_y = _mm256_set1_ps(hi_y);
+    size_t ret = 0, i = 0;
+
+    for (; i+8<=n; i+=8) {
+        __m256 px = _mm256_loadu_ps(xs + i);
+        __m256 py = _mm256_loadu_ps(ys + i);
+        __m256 in_x = _mm256_and_ps(_mm256_cmp_ps(vlo_x, px, _CMP_LE_OQ), _mm256_cmp_ps(px, vhi_x, _CMP_LE_OQ));
+        __m256 in_y = _mm256_and_ps(_mm256_cmp_ps(vlo_y, py, _CMP_LE_OQ), _mm256_cmp_ps(py, vhi_y, _CMP_LE_OQ));
+        unsigned int mask = _mm256_movemask_ps(_mm256_and_ps(in_x, in_y));
+        ret += AppendMaskIndices(mask, i, idx + ret);
+    }
+    for (size_t j=ScalarFilterBox(xs + i, ys + i, n - i, lo_x, lo_y, hi_x, hi_y, idx + ret); j>0; --j, ++ret) {
+        idx[ret] += i;
+    }
+
+    return ret;
+}
+
+// the selected indices are written with a single compress store
+__attribute__((target("avx512f")))
+size_t Avx512FilterCircle(const float* xs, const float* ys, size_t n,
+                          float cx, float cy, float rad, uint32_t* idx) {
+    const __m512 vcx = _mm512_set1_ps(cx);
+    const __m512 vcy = _mm512_set1_ps(cy);
+    const __m512 vrad2 = _mm512_set1_ps(rad * rad);
+    const __m512i step = _mm512_set1_epi32(16);
+    __m512i vidx = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    size_t ret = 0, i = 0;
+
+    for (; i+16<=n; i+=16) {
+        __m512 deltax = _mm512_sub_ps(_mm512_loadu_ps(xs + i), vcx);
+        __m512 deltay = _mm512_sub_ps(_mm512_loadu_ps(ys + i), vcy);
+        __m512 dist = _mm512_add_ps(_mm512_mul_ps(deltax, deltax), _mm512_mul_ps(deltay, deltay));
+        __mmask16 mask = _mm512_cmp_ps_mask(dist, vrad2, _CMP_LE_OQ);
+        _mm512_mask_compressstoreu_epi32(idx + ret, mask, vidx);
+        ret += __builtin_popcount(mask);
+        vidx = _mm512_add_epi32(vidx, step);
+    }
+    for (size_t j=ScalarFilterCircle(xs + i, ys + i, n - i, cx, cy, rad, idx + ret); j>0; --j, ++ret) {
+        idx[ret] += i;
+    }
+
+    return ret;
+}
+
+__attribute__((target("avx512f")))
+size_t Avx512FilterBox(const float* xs, const float* ys, size_t n,
+                       float lo_x, float lo_y, float hi_x, float hi_y, uint32_t* idx) {
+    const __m512 vlo_x = _mm512_set1_ps(lo_x), vhi_x = _mm512_set1_ps(hi_x);
+    const __m512 vlo_y = _mm512_set1_ps(lo_y), vhi_y = _mm512_set1_ps(hi_y);
+    const __m512i step = _mm512_set1_epi32(16);
+    __m512i vidx = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    size_t ret = 0, i = 0;
+
+    for (; i+16<=n; i+=16) {
+        __m512 px = _mm512_loadu_ps(xs + i);
+        __m512 py = _mm512_loadu_ps(ys + i);
+        __mmask16 mask = _mm512_cmp_ps_mask(vlo_x, px, _CMP_LE_OQ);
+        mask = _mm512_mask_cmp_ps_mask(mask, px, vhi_x, _CMP_LE_OQ);
+        mask = _mm512_mask_cmp_ps_mask(mask, vlo_y, py, _CMP_LE_OQ);
+        mask = _mm512_mask_cmp_ps_mask(mask, py, vhi_y, _CMP_LE_OQ);
+        _mm512_mask_compressstoreu_epi32(idx + ret, mask, vidx);
+        ret += __builtin_popcount(mask);
+        vidx = _mm512_add_epi32(vidx, step);
+    }
+    for (size_t j=ScalarFilterBox(xs + i, ys + i, n - i, lo_x, lo_y, hi_x, hi_y, idx + ret); j>0; --j, ++ret) {
+        idx[ret] += i;
+    }
+
+    return ret;
+}
+
+#endif  // FILTER_X86
+
+}  // namespace
+
+bool IsSupported(FilterBackend backend) {
+    switch (backend) {
+    case FilterBackend::SCALAR:
+        return true;
+#ifdef FILTER_X86
+    case FilterBackend::AVX2:
+        return __builtin_cpu_supports("avx2");
+    case FilterBackend::AVX512:
+        return __builtin_cpu_supports("avx512f");
+#endif
+    default:
+        return false;
+    }
+}
+
+FilterBackend BestBackend() {
+    static const FilterBackend best = IsSupported(FilterBackend::AVX512) ? FilterBackend::AVX512 :
+                                      IsSupported(FilterBackend::AVX2) ? FilterBackend::AVX2 :
+                                      FilterBackend::SCALAR;
+    return best;
+}
+
+const char* BackendName(FilterBackend backend) {
+    switch (backend) {
+    case FilterBackend::SCALAR:
+        return "scalar";
+    case FilterBackend::AVX2:
+        return "avx2";
+    case FilterBackend::AVX512:
+        return "avx512";
+    }
+    return "unknown";
+}
+
+size_t FilterCircle(FilterBackend backend, const float* xs, const float* ys, size_t n,
+                    float cx, float cy, float rad, uint32_t* idx) {
+#ifdef FILTER_X86
+    if (backend == FilterBackend::AVX512)
+        return Avx512FilterCircle(xs, ys, n, cx, cy, rad, idx);
+    if (backend == FilterBackend::AVX2)
+        return Avx2FilterCircle(xs, ys, n, cx, cy, rad, idx);
+#endif
+    return ScalarFilterCircle(xs, ys, n, cx, cy, rad, idx);
+}
+
+size_t FilterBox(FilterBackend backend, const float* xs, const float* ys, size_t n,
+                 float lo_x, float lo_y, float hi_x, float hi_y, uint32_t* idx) {
+#ifdef FILTER_X86
+    if (backend == FilterBackend::AVX512)
+        return Avx512FilterBox(xs, ys, n, lo_x, lo_y, hi_x, hi_y, idx);
+    if (backend == FilterBackend::AVX2)
+        return Avx2FilterBox(xs, ys, n, lo_x, lo_y, hi_x, hi_y, idx);
+#endif
+    return ScalarFilterBox(xs, ys, n, lo_x, lo_y, hi_x, hi_y, idx);
+}
+
+size_t FilterRectangle(FilterBackend backend, const float* xs, const float* ys, size_t n,
+                       float x, float y, float dx, float dy, uint32_t* idx) {
+    return FilterBox(backend, xs, ys, n, x - dx, y - dy, x + dx, y + dy, idx);
+}
+
+size_t FilterCircle(const float* xs, const float* ys, size_t n,
+                    float cx, float cy, float rad, uint32_t* idx) {
+    return FilterCircle(BestBackend(), xs, ys, n, cx, cy, rad, idx);
+}
+
+size_t FilterRectangle(const float* xs, const float* ys, size_t n,
+                       float x, float y, float dx, float dy, uint32_t* idx) {
+    return FilterRectangle(BestBackend(), xs, ys, n, x, y, dx, dy, idx);
+}
+
+size_t FilterBox(const float* xs, const float* ys, size_t n,
+                 float lo_x, float lo_y, float hi_x, float hi_y, uint32_t* idx) {
+    return FilterBox(BestBackend(), xs, ys, n, lo_x, lo_y, hi_x, hi_y, idx);
+}
+
+}
@@ -0,0 +1,49 @@
+#ifndef GRPC_COMMON_CPP_FILTER_H_
+#define GRPC_COMMON_CPP_FILTER_H_
+
+#include <cstddef>
+#include <cstdint>
+
+// Batch point-in-range filter kernels
+//
+// The points are given as structure-of-arrays coordinates xs[i], ys[i], and
+// the kernels write the indices of the points inside the range to idx, in
+// increasing order. The results are bit-identical to IntersectWithRange of
+// global.h, the SIMD kernels evaluate the same float expressions.
+enum class FilterBackend { SCALAR, AVX2, AVX512 };
+
+namespace FILTER {
+
+// whether the backend can run on this cpu
+bool IsSupported(FilterBackend backend);
+
+// the fastest backend supported by this cpu
+FilterBackend BestBackend();
+
+const char* BackendName(FilterBackend backend);
+
+// points with (x-cx)^2 + (y-cy)^2 <= rad^2, returns the number of indices written
+size_t FilterCircle(FilterBackend backend, const float* xs, const float* ys, size_t n,
+                    float cx, float cy, float rad, uint32_t* idx);
+
+// points with x-dx <= x <= x+dx and y-dy <= y <= y+dy
+size_t FilterRectangle(FilterBackend backend, const float* xs, const float* ys, size_t n,
+                       float x, float y, float dx, float dy, uint32_t* idx);
+
+// points with lo_x <= x <= hi_x and lo_y <= y <= hi_y
+size_t FilterBox(FilterBackend backend, const float* xs, const float* ys, size_t n,
+                 float lo_x, float lo_y, float hi_x, float hi_y, uint32_t* idx);
+
+// the same with BestBackend()
+size_t FilterCircle(const float* xs, const float* ys, size_t n,
+                    float cx, float cy, float rad, uint32_t* idx);
+
+size_t FilterRectangle(const float* xs, const float* ys, size_t n,
+                       float x, float y, float dx, float dy, uint32_t* idx);
+
+size_t FilterBox(const float* xs, const float* ys, size_t n,
+                 float lo_x, float lo_y, float hi_x, float hi_y, uint32_t* idx);
+
+}
+
+#endif // GRPC_COMMON_CPP_FILTER_H_
@@ -1,11 +1,20 @@
 #include <algorithm>
 #include <cctype>
+#include <charconv>
 #include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "global.h"
 
@@ -215,104 +224,242 @@ int GetSiloID(int argc, char** argv) {
     return std::stoi(db_path.c_str());
 }
 
-void GetInputData(const std::string& fileName, std::vector<Record_t>& recordVector) {
-    std::ifstream fin(fileName);
-    if (!fin.is_open()) {
-        printf("Failed to open %s\n", fileName.c_str());
-        abort();
+// look up an optional --name=value argument in any position
+std::string GetArgument(int argc, char** argv, const std::string& name, const std::string& default_value) {
+    for (int i=1; i<argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.size() > name.size() && arg.compare(0, name.size(), name) == 0 && 
+            (arg[name.size()] == ' ' || arg[name.size()] == '=')) {
+            return arg.substr(name.size() + 1);
+        }
     }
 
-    int n;
+    return default_value;
+}
 
-    fin >> n;
-    if (fin.fail()) {
-        printf("Failed to parse the data record %s\n", fileName.c_str());
-        abort();
+size_t GetSizeArgument(int argc, char** argv, const std::string& name, const size_t default_value, const std::string& usage) {
+    std::string arg = GetArgument(argc, argv, name, "");
+    if (arg.empty())
+        return default_value;
+
+    size_t value = 0;
+    auto res = std::from_chars(arg.data(), arg.data() + arg.size(), value);
+    if (res.ec != std::errc() || res.ptr != arg.data() + arg.size()) {
+        printf("Invalid value %s for %s\n", arg.c_str(), name.c_str());
+        printf("Usage: %s %s\n", argv[0], usage.c_str());
+        exit(-1);
     }
+    return value;
+}
 
-    recordVector.resize(n);
-    for (int i=0; i<n; ++i) {
-        fin >> recordVector[i].ID >> recordVector[i].x >> recordVector[i].y; 
-        #ifdef LOCAL_DEBUG
-        printf("Record #%d: ID=%d, location=(%.2f, %.2f)\n", i+1, recordVector[i].ID, recordVector[i].x, recordVector[i].y);
-        #endif
+// Parallel text loader
+//
+// The file is mapped and split into byte ranges at line boundaries. The
+// first pass counts the records of each range, so the second pass can
+// parse every range on its own thread straight into its slot of the
+// preallocated output.
+namespace {
+
+inline bool IsBlank(const char c) {
+    return c==' ' || c=='\t' || c=='\r';
+}
+
+template<typename V>
+inline bool ParseValue(const char*& p, const char* end, V& value) {
+    while (p<end && IsBlank(*p))
+        ++p;
+    if (p<end && *p=='+')
+        ++p;
+    auto res = std::from_chars(p, end, value);
+    if (res.ec != std::errc())
+        return false;
+    p = res.ptr;
+    return true;
+}
+
+// skip a word such as "RangeQuery" in front of the values of a line
+inline void SkipWord(const char*& p, const char* end) {
+    while (p<end && IsBlank(*p))
+        ++p;
+    if (p<end && std::isalpha((unsigned char)*p)) {
+        while (p<end && !IsBlank(*p))
+            ++p;
     }
-    fin.close();
 }
 
-QueryType_t GetQueryType(const std::string& str) {
-    if (str == "RangeQuery") {
-        return QueryType_t::RANGE_QUERY;
-    } else if (str == "RangeCount") {
-        return QueryType_t::RANGE_COUNT;
-    } else if (str == "DistanceJoin") {
-        return QueryType_t::DISTANCE_JOIN;
-    } else {
-        return QueryType_t::UNDEFINED;
+inline bool IsEmptyLine(const char* p, const char* end) {
+    while (p<end && IsBlank(*p))
+        ++p;
+    return p == end;
+}
+
+// call f(line_begin, line_end) for every non-empty line of [p, end)
+template<typename Func_t>
+inline void ForEachLine(const char* p, const char* end, Func_t f) {
+    while (p < end) {
+        const char* line_end = static_cast<const char*>(memchr(p, '\n', end - p));
+        if (line_end == NULL)
+            line_end = end;
+        if (!IsEmptyLine(p, line_end) && !f(p, line_end))
+            return;
+        p = line_end + 1;
     }
 }
 
-void GetInputQuery(const std::string& fileName, std::vector<Rectangle_t>& queries) {
-    std::ifstream fin(fileName);
-    if (!fin.is_open()) {
+// parse "n" and then one record per line with parse_line(begin, end, record)
+template<typename T, typename ParseLine_t>
+void ParseLinesParallel(const std::string& fileName, std::vector<T>& out, ParseLine_t parse_line, size_t num_threads) {
+    // step1. Map the file
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd < 0) {
         printf("Failed to open %s\n", fileName.c_str());
         abort();
     }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        printf("Failed to parse %s\n", fileName.c_str());
+        abort();
+    }
+    const size_t file_size = st.st_size;
+    void* addr = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        printf("Failed to map %s\n", fileName.c_str());
+        abort();
+    }
+    madvise(addr, file_size, MADV_SEQUENTIAL);
+    const char* begin = static_cast<const char*>(addr);
+    const char* end = begin + file_size;
+
+    // step2. Parse the number of records
+    const char* p = begin;
+    while (p<end && std::isspace((unsigned char)*p))
+        ++p;
+    int n = 0;
+    if (!ParseValue(p, end, n) || n < 0) {
+        printf("Failed to parse the number of records, %s\n", fileName.c_str());
+        abort();
+    }
 
-    int qn;
-    std::string queryType;
+    // step3. Split the records at line boundaries, ranges of less than 1 MB are not worth a thread
+    const size_t MIN_RANGE_SIZE = 1 << 20;
+    if (num_threads == 0)
+        num_threads = std::max(1u, std::thread::hardware_concurrency());
+    num_threads = std::max<size_t>(1, std::min(num_threads, (size_t)(end - p) / MIN_RANGE_SIZE));
+    std::vector<const char*> bounds(num_threads + 1, end);
+    bounds[0] = p;
+    for (size_t t=1; t<num_threads; ++t) {
+        const char* q = std::max(bounds[t-1], p + (end - p) / num_threads * t);
+        const char* nl = static_cast<const char*>(memchr(q, '\n', end - q));
+        bounds[t] = (nl == NULL) ? end : nl + 1;
+    }
 
-    fin >> qn;
-    if (fin.fail()) {
-        printf("Failed to parse the query number, %s\n", fileName.c_str());
+    auto run = [num_threads](auto job) {
+        std::vector<std::thread> workers;
+        for (size_t t=1; t<num_threads; ++t)
+            workers.emplace_back(job, t);
+        job(0);
+        for (auto& worker : workers)
+            worker.join();
+    };
+
+    // step4. Count the records of each range, then parse each range into its slot
+    std::vector<size_t> starts(num_threads + 1, 0);
+    run([&](size_t t) {
+        size_t cnt = 0;
+        ForEachLine(bounds[t], bounds[t+1], [&](const char*, const char*) { ++cnt; return true; });
+        starts[t+1] = cnt;
+    });
+    for (size_t t=0; t<num_threads; ++t)
+        starts[t+1] += starts[t];
+    if (starts[num_threads] < (size_t)n) {
+        printf("Failed to parse %s: %d records expected, %zu found\n", fileName.c_str(), n, starts[num_threads]);
         abort();
     }
 
-    queries.resize(qn);
-    for (int i=0; i<qn; ++i) {
-        fin >> queries[i].x >> queries[i].y >> queries[i].dx >> queries[i].dy;
-        if (fin.fail()) {
-            std::cout << "Failed to parse the %d-th query " << i+1 << std::endl;
+    out.resize(n);
+    std::vector<size_t> failed(num_threads, SIZE_MAX);
+    run([&](size_t t) {
+        size_t i = starts[t];
+        ForEachLine(bounds[t], bounds[t+1], [&](const char* line, const char* line_end) {
+            // the lines after the first n are ignored
+            if (i >= (size_t)n)
+                return false;
+            if (!parse_line(line, line_end, out[i])) {
+                failed[t] = i;
+                return false;
+            }
+            ++i;
+            return true;
+        });
+    });
+    munmap(addr, file_size);
+
+    for (size_t t=0; t<num_threads; ++t) {
+        if (failed[t] != SIZE_MAX) {
+            printf("Failed to parse the %zu-th record of %s\n", failed[t]+1, fileName.c_str());
             abort();
-        }  
-        queries[i].qtype = QueryType_t::RANGE_QUERY;
+        }
     }
-    
+}
 
-    fin.close();
 }
 
-void GetInputQuery(const std::string& fileName, std::vector<Circle_t>& queries) {
-    std::ifstream fin(fileName);
-    if (!fin.is_open()) {
-        printf("Failed to open %s\n", fileName.c_str());
-        abort();
-    }
+void GetInputData(const std::string& fileName, std::vector<Record_t>& recordVector, size_t num_threads) {
+    ParseLinesParallel(fileName, recordVector, [](const char* p, const char* end, Record_t& rec) {
+        return ParseValue(p, end, rec.ID) && ParseValue(p, end, rec.x) && ParseValue(p, end, rec.y);
+    }, num_threads);
 
-    int qn;
-    std::string queryType;
+    #ifdef LOCAL_DEBUG
+    for (size_t i=0; i<recordVector.size(); ++i) {
+        printf("Record #%zu: ID=%d, location=(%.2f, %.2f)\n", i+1, recordVector[i].ID, recordVector[i].x, recordVector[i].y);
+    }
+    #endif
+}
 
-    fin >> qn;
-    std::cout << "query number = " << qn << std::endl;
-    if (fin.fail()) {
-        printf("Failed to parse the query number %s\n", fileName.c_str());
-        abort();
+size_t GetPeakRSS() {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
     }
+    // ru_maxrss is in kilobytes on Linux
+    return (size_t)usage.ru_maxrss * 1024;
+}
 
-    queries.resize(qn);
-    for (int i=0; i<qn; ++i) {
-        fin >> queries[i].x >> queries[i].y >> queries[i].rad;
-        if (fin.fail()) {
-            std::cout << "Failed to parse the " << i+1 << "-th query" << std::endl;
-            abort();
-        }  
-        queries[i].qtype = QueryType_t::RANGE_QUERY;
-        #ifdef LOCAL_DEBUG
-        printf("Query #%d: %s, location=(%.2lf, %.2lf), rad=%.2lf\n", i+1, queryType.c_str(), queries[i].x, queries[i].y, queries[i].rad);
-        #endif
+QueryType_t GetQueryType(const std::string& str) {
+    if (str == "RangeQuery") {
+        return QueryType_t::RANGE_QUERY;
+    } else if (str == "RangeCount") {
+        return QueryType_t::RANGE_COUNT;
+    } else if (str == "DistanceJoin") {
+        return QueryType_t::DISTANCE_JOIN;
+    } else {
+        return QueryType_t::UNDEFINED;
     }
+}
 
-    fin.close();
+void GetInputQuery(const std::string& fileName, std::vector<Rectangle_t>& queries, size_t num_threads) {
+    ParseLinesParallel(fileName, queries, [](const char* p, const char* end, Rectangle_t& query) {
+        SkipWord(p, end);
+        query.qtype = QueryType_t::RANGE_QUERY;
+        return ParseValue(p, end, query.x) && ParseValue(p, end, query.y) &&
+               ParseValue(p, end, query.dx) && ParseValue(p, end, query.dy);
+    }, num_threads);
+}
+
+void GetInputQuery(const std::string& fileName, std::vector<Circle_t>& queries, size_t num_threads) {
+    ParseLinesParallel(fileName, queries, [](const char* p, const char* end, Circle_t& query) {
+        SkipWord(p, end);
+        query.qtype = QueryType_t::RANGE_QUERY;
+        return ParseValue(p, end, query.x) && ParseValue(p, end, query.y) && ParseValue(p, end, query.rad);
+    }, num_threads);
+    std::cout << "query number = " << queries.size() << std::endl;
+
+    #ifdef LOCAL_DEBUG
+    for (size_t i=0; i<queries.size(); ++i) {
+        printf("Query #%zu: location=(%.2lf, %.2lf), rad=%.2lf\n", i+1, queries[i].x, queries[i].y, queries[i].rad);
+    }
+    #endif
 }
 
 void GetIPAddresses(const std::string& fileName, std::vector<std::string>& ip_addresses) {
@@ -358,4 +505,62 @@ Record_t DeserializeRecord(const std::vector<unsigned char>& charVector) {
     return ret;
 }
 
+void SerializeRecord(const Record_t& rec, unsigned char* des) {
+    memcpy(des, &rec, sizeof(Record_t));
+    memset(des+sizeof(Record_t), 0, RECORD_BLOCK_SIZE-sizeof(Record_t));
+}
+
+Record_t DeserializeRecord(const unsigned char* src) {
+    Record_t ret;
+    memcpy(&ret, src, sizeof(Record_t));
+    return ret;
+}
+
+size_t GetRecordsPerChunk(const size_t chunk_size) {
+    size_t sz = (chunk_size == 0) ? DEFAULT_CHUNK_SIZE : chunk_size;
+    return std::max<size_t>(1, sz / RECORD_BLOCK_SIZE);
+}
+
+size_t GetRecordsPerBatch(const size_t chunk_size) {
+    size_t sz = (chunk_size == 0) ? DEFAULT_CHUNK_SIZE : chunk_size;
+    return std::max<size_t>(1, sz / (sizeof(int32_t) + 2*sizeof(float)));
+}
+
+void MakeRecordBatch(const Record_t* records, const size_t n, RecordBatch& batch) {
+    batch.clear_ids();
+    batch.clear_xs();
+    batch.clear_ys();
+    batch.mutable_ids()->Reserve(n);
+    batch.mutable_xs()->Reserve(n);
+    batch.mutable_ys()->Reserve(n);
+    for (size_t i=0; i<n; ++i) {
+        batch.add_ids(records[i].ID);
+        batch.add_xs(records[i].x);
+        batch.add_ys(records[i].y);
+    }
+}
+
+// the columns of a batch have the same length
+bool CheckRecordBatch(const RecordBatch& batch) {
+    const int n = batch.ids_size();
+    return batch.xs_size() == n && batch.ys_size() == n;
+}
+
+bool AppendRecordBatch(const RecordBatch& batch, std::vector<Record_t>& records) {
+    if (!CheckRecordBatch(batch)) {
+        printf("Received a malformed record batch\n");
+        return false;
+    }
+
+    const size_t n = batch.ids_size();
+    size_t offset = records.size();
+    records.resize(offset + n);
+    for (size_t i=0; i<n; ++i) {
+        records[offset+i].ID = batch.ids(i);
+        records[offset+i].x = batch.xs(i);
+        records[offset+i].y = batch.ys(i);
+    }
+    return true;
+}
+
 }  // namespace ICDE18
@@ -6,11 +6,13 @@
 #include <cmath>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <string>
 
 #include "ICDE18.grpc.pb.h"
 
 //#define LOCAL_DEBUG
+// the default number of grids per side, see --grid_k and --points_per_cell of silo
 #define GRID_NUM_PER_SIDE 10
 
 using ICDE18::Point;
@@ -19,6 +21,7 @@ using ICDE18::Circle;
 using ICDE18::CircleQueryRange;
 using ICDE18::RectangleQueryRange;
 using ICDE18::Record;
+using ICDE18::RecordBatch;
 using ICDE18::RecordSummary;
 using ICDE18::IntVector;
 using ICDE18::FloatVector;
@@ -137,8 +140,26 @@ bool IntersectWithRange(const Record_t& a, const Rectangle_t& b);
 bool IntersectWithRange(const Record_t& a, const Circle_t& b);
 
 // Serialize & De-serialize
+//
+// A record is padded to a whole number of 16-byte AES blocks.
+constexpr size_t RECORD_BLOCK_SIZE = ((sizeof(Record_t)+15)/16) * 16;
 std::vector<unsigned char> SerializeRecord(const Record_t& rec);
 Record_t DeserializeRecord(const std::vector<unsigned char>& charVector);
+void SerializeRecord(const Record_t& rec, unsigned char* des);
+Record_t DeserializeRecord(const unsigned char* src);
+
+// Records are streamed in chunks of at most this many bytes by default
+constexpr size_t DEFAULT_CHUNK_SIZE = 64 * 1024;
+size_t GetRecordsPerChunk(const size_t chunk_size);
+
+// Columnar record batches
+//
+// A batch received from a peer is checked before use, a malformed one is
+// rejected with false rather than taking down the process.
+size_t GetRecordsPerBatch(const size_t chunk_size);
+void MakeRecordBatch(const Record_t* records, const size_t n, RecordBatch& batch);
+bool CheckRecordBatch(const RecordBatch& batch);
+bool AppendRecordBatch(const RecordBatch& batch, std::vector<Record_t>& records);
 
 
 // process vector basic function
@@ -184,10 +205,17 @@ std::string GetQueryFilePath(int argc, char** argv);
 std::string GetIPAddress(int argc, char** argv);
 std::string GetSiloIPFilePath(int argc, char** argv);
 int GetSiloID(int argc, char** argv);
-void GetInputData(const std::string& fileName, std::vector<Record_t>& recordVector);
+std::string GetArgument(int argc, char** argv, const std::string& name, const std::string& default_value);
+// a non-negative integer argument, a malformed value prints usage and exits
+size_t GetSizeArgument(int argc, char** argv, const std::string& name, const size_t default_value, const std::string& usage);
+// The loaders parse the text files on num_threads threads, 0 means all cores
+void GetInputData(const std::string& fileName, std::vector<Record_t>& recordVector, size_t num_threads=0);
+
+// the peak resident set size of this process [bytes]
+size_t GetPeakRSS();
 QueryType_t GetQueryType(const std::string& str);
-void GetInputQuery(const std::string& fileName, std::vector<Rectangle_t>& queries);
-void GetInputQuery(const std::string& fileName, std::vector<Circle_t>& queries);
+void GetInputQuery(const std::string& fileName, std::vector<Rectangle_t>& queries, size_t num_threads=0);
+void GetInputQuery(const std::string& fileName, std::vector<Circle_t>& queries, size_t num_threads=0);
 void GetIPAddresses(const std::string& fileName, std::vector<std::string>& ip_addresses);
 
 
@@ -222,23 +250,36 @@ public:
         endTime = std::chrono::steady_clock::now(); 
     }
 
+    // elapsed time [ms] since start, for queries that are timed by the caller
+    static float GetElapsedTime(const std::chrono::steady_clock::time_point& start) {
+        auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+        return duration.count();
+    }
+
     void LogAddComm(float _queryComm=0.0f) {
+        std::lock_guard<std::mutex> lock(logMutex);
         queryComm += _queryComm;
     }
 
     void LogOneQuery(float _queryComm=0.0f) {
-        LogAddComm(_queryComm);
-
         auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(endTime - startTime);
         float _queryTime = duration.count();
 
-        queryNum += 1;
-        queryTime += _queryTime;
+        LogOneQuery(_queryComm, _queryTime);
 
         endTime = startTime;
     }
 
+    // thread-safe, does not touch the shared start and end timers
+    void LogOneQuery(float _queryComm, float _queryTime) {
+        std::lock_guard<std::mutex> lock(logMutex);
+        queryNum += 1;
+        queryTime += _queryTime;
+        queryComm += _queryComm;
+    }
+
     void Print() {
+        std::lock_guard<std::mutex> lock(logMutex);
         float AvgQueryTime = (queryNum==0) ? 0 : (queryTime/queryNum); // ms
         float AvgQueryComm = (queryNum==0) ? 0 : (queryComm/queryNum); // bytes
         AvgQueryTime /= 1;
@@ -250,6 +291,7 @@ public:
 
 private:
     std::chrono::steady_clock::time_point startTime, endTime;
+    std::mutex logMutex;
     int queryNum;
     float queryTime;
     float queryComm;
@@ -3,18 +3,28 @@
 
 #include <algorithm>
 #include <array>
+#include <cerrno>
 #include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
 #include <vector>
 #include <iostream>
 #include <chrono>
 
 #include "global.h"
 #include "differentialprivacy.h"
+#include "filter.h"
+#include "points.hpp"
 
 namespace INDEX {
 
 using ICDE18::Record_t;
 using ICDE18::Circle_t;
+using ICDE18::Rectangle_t;
 using ICDE18::IntersectWithRange;
 using DIFFERENTIALPRIVACY::LaplaceMechanism;
 
@@ -22,39 +32,104 @@ constexpr size_t ipow(size_t base, int exp, size_t result=1) {
     return exp < 1 ? result : ipow(base*base, exp/2, (exp % 2) ? result*base : result);
 }
 
-// uniform K by K ... grid 
-template<size_t K, size_t dim=2>
+// the largest number of grids per side, bounds the size of the published counts
+constexpr size_t MAX_GRID_NUM_PER_SIDE = 1024;
+
+// the number of grids per side so that a grid holds about points_per_cell points
+inline size_t ChooseGridK(const size_t num_of_points, const size_t points_per_cell, const size_t dim=2) {
+    if (points_per_cell == 0)
+        return GRID_NUM_PER_SIDE;
+    double cells = std::max(1.0, (double)num_of_points / points_per_cell);
+    size_t K = (size_t)std::llround(std::pow(cells, 1.0 / dim));
+    return std::min(std::max<size_t>(K, 1), MAX_GRID_NUM_PER_SIDE);
+}
+
+// run f(0), ..., f(num_threads-1) on num_threads threads, f(0) on the caller
+template<typename Func_t>
+inline void ParallelRun(const size_t num_threads, Func_t f) {
+    std::vector<std::thread> workers;
+    for (size_t t=1; t<num_threads; ++t) {
+        workers.emplace_back(f, t);
+    }
+    f(0);
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+// the largest number of leaves per side of a split grid
+constexpr size_t MAX_GRID_SPLIT = 16;
+
+// the share of the privacy budget spent on the level-1 counts that choose the
+// splits of an adaptive index, the rest is spent on the leaf counts
+constexpr float SPLIT_EPSILON_SHARE = 0.5f;
+
+// uniform K by K ... grid, K is chosen at runtime
+//
+// The grid may be made adaptive by split_dense_grids: every grid i is then
+// divided into S_i by S_i leaves, where S_i grows with its noisy level-1
+// count. The published grid ids, counts and record ranges are those of the
+// leaves, numbered grid by grid and row by row within a grid. A grid that is
+// not split is a single leaf, so without splits the leaf ids are the grid ids.
+template<size_t dim=2>
 class GridIndex {
 
 using Point_t = ICDE18::Record_t;
-using Points_t = std::vector<Point_t>;
+using Points_t = ICDE18::PointStore;
 using Range = std::pair<size_t, size_t>;
 using COUNT_TYPE = int;
 
 public:
-    GridIndex(const std::shared_ptr<Points_t>& _points) {
+    // the points are reordered by grid id, and shared with the caller.
+    // The build runs on num_threads threads, 0 means all cores.
+    GridIndex(const std::shared_ptr<Points_t>& _points, const size_t _K=GRID_NUM_PER_SIDE,
+              size_t num_threads=0) : K(_K) {
         std::cout << "Construct Uniform Grid K=" << K << std::endl;
         auto start = std::chrono::steady_clock::now();
 
+        if (K == 0 || K > MAX_GRID_NUM_PER_SIDE) {
+            printf("invalid number of grids per side K=%zu\n", K);
+            exit(-1);
+        }
+        const size_t num_of_grids = ipow(K, dim);
+        counts.resize(num_of_grids);
+
         points_ptr = _points;
         Points_t& points = *points_ptr;
         this->num_of_points = points.size();
 
+        // a thread gets at least MIN_POINTS_PER_THREAD points
+        const size_t MIN_POINTS_PER_THREAD = 1 << 16;
+        if (num_threads == 0)
+            num_threads = std::max(1u, std::thread::hardware_concurrency());
+        num_threads = std::max<size_t>(1, std::min(num_threads, num_of_points / MIN_POINTS_PER_THREAD));
+        // points [thread_begin(t), thread_begin(t+1)) belong to thread t
+        auto thread_begin = [&](const size_t t) { return num_of_points * t / num_threads; };
+
         // dimension offsets when computing bucket ID
         for (size_t i=0; i<dim; ++i) {
             this->dim_offset[i] = ipow(K, i);
         }
 
-        // boundaries of each dimension
+        // step1. boundaries of each dimension, reduced from the bounds of each thread
+        std::vector<std::array<float, dim>> thread_mins(num_threads), thread_maxs(num_threads);
+        ParallelRun(num_threads, [&](const size_t t) {
+            thread_mins[t].fill(std::numeric_limits<float>::max());
+            thread_maxs[t].fill(std::numeric_limits<float>::lowest());
+            for (size_t i=0; i<dim; ++i) {
+                const float* values = (i==0) ? points.x_data() : points.y_data();
+                for (size_t j=thread_begin(t); j<thread_begin(t+1); ++j) {
+                    thread_mins[t][i] = std::min(values[j], thread_mins[t][i]);
+                    thread_maxs[t][i] = std::max(values[j], thread_maxs[t][i]);
+                }
+            }
+        });
         std::fill(mins.begin(), mins.end(), std::numeric_limits<float>::max());
-        std::fill(maxs.begin(), maxs.end(), std::numeric_limits<float>::min());
-
-        for (int i=0; i<dim; ++i) {
-            float value;
-            for (auto& p : points) {
-                value = (i==0) ? p.x : p.y;
-                mins[i] = std::min(value, mins[i]);
-                maxs[i] = std::max(value, maxs[i]);
+        std::fill(maxs.begin(), maxs.end(), std::numeric_limits<float>::lowest());
+        for (size_t t=0; t<num_threads; ++t) {
+            for (size_t i=0; i<dim; ++i) {
+                mins[i] = std::min(thread_mins[t][i], mins[i]);
+                maxs[i] = std::max(thread_maxs[t][i], maxs[i]);
             }
         }
 
@@ -62,15 +137,76 @@ public:
         for (size_t i=0; i<dim; ++i) {
             widths[i] = (maxs[i] - mins[i]) / K;
         }
-        
-        // insert points to buckets
-        counts.fill(0);
-        for (size_t i=0; i<points.size(); ++i) {
-            size_t pid = compute_id(points[i]);
-            buckets[pid].emplace_back(i);
-            ++counts[pid];
+
+        // step2. the grid id of each point and a histogram of the grid ids per thread,
+        // 32-bit counts are enough as the record ids of a silo are int
+        std::vector<uint32_t> gids(num_of_points);
+        std::vector<std::vector<uint32_t>> histograms(num_threads);
+        std::vector<char> thread_sorted(num_threads);
+        ParallelRun(num_threads, [&](const size_t t) {
+            std::vector<uint32_t>& histogram = histograms[t];
+            histogram.assign(num_of_grids, 0);
+            bool sorted = true;
+            for (size_t i=thread_begin(t); i<thread_begin(t+1); ++i) {
+                gids[i] = compute_id(points.x(i), points.y(i));
+                ++histogram[gids[i]];
+                sorted = sorted && (i == thread_begin(t) || gids[i-1] <= gids[i]);
+            }
+            thread_sorted[t] = sorted;
+        });
+
+        // step3. the offsets of each grid, and where each thread writes its points of a grid.
+        // The histograms become the cursors in place, relative to the offset of the grid,
+        // so the build needs no second num_threads by num_of_grids array.
+        offsets.resize(num_of_grids + 1);
+        offsets[0] = 0;
+        std::vector<std::vector<uint32_t>>& cursors = histograms;
+        for (size_t gid=0; gid<num_of_grids; ++gid) {
+            uint32_t cursor = 0;
+            for (size_t t=0; t<num_threads; ++t) {
+                const uint32_t count = histograms[t][gid];
+                cursors[t][gid] = cursor;
+                cursor += count;
+            }
+            offsets[gid+1] = offsets[gid] + cursor;
+            counts[gid] = cursor;
+        }
+
+        // step4. scatter the points to the CSR layout, stable within each grid.
+        // Points already in grid order, e.g. from a pre-sorted binary file, stay in place.
+        bool sorted = std::all_of(thread_sorted.begin(), thread_sorted.end(), [](char c) { return c; });
+        for (size_t t=1; t<num_threads && sorted; ++t) {
+            sorted = gids[thread_begin(t)-1] <= gids[thread_begin(t)];
+        }
+        if (!sorted) {
+            Points_t::Array<int> sorted_ids(num_of_points);
+            Points_t::Array<float> sorted_xs(num_of_points), sorted_ys(num_of_points);
+            ParallelRun(num_threads, [&](const size_t t) {
+                std::vector<uint32_t>& cursor = cursors[t];
+                for (size_t i=thread_begin(t); i<thread_begin(t+1); ++i) {
+                    const size_t j = offsets[gids[i]] + cursor[gids[i]]++;
+                    sorted_ids[j] = points.id(i);
+                    sorted_xs[j] = points.x(i);
+                    sorted_ys[j] = points.y(i);
+                }
+            });
+            points.assign(std::move(sorted_ids), std::move(sorted_xs), std::move(sorted_ys));
+        }
+        cursors.clear();
+        cursors.shrink_to_fit();
+        gids.clear();
+        gids.shrink_to_fit();
+
+        // every grid is a single leaf until split_dense_grids
+        splits.assign(num_of_grids, 1);
+        leaf_begin.resize(num_of_grids + 1);
+        for (size_t c=0; c<=num_of_grids; ++c) {
+            leaf_begin[c] = c;
         }
 
+        // step5. tight bounding box of each grid
+        compute_leaf_boxes(num_threads);
+
         auto end = std::chrono::steady_clock::now();
         build_time = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
         std::cout << "Build Time: " << build_time << " [ms]" << std::endl;
@@ -88,15 +224,119 @@ public:
         #endif
     }
 
+    // the budget is split evenly among the published leaves
     void perturb_index_counts(float epsilon) {
         const double UPPER_BOUND = 1e3;
-        float grid_epsilon = epsilon / ipow(K, dim);
+        float grid_epsilon = epsilon / counts.size();
         for (int i=0; i<counts.size(); ++i) {
             double noise = LaplaceMechanism(1.0, grid_epsilon);
             if (noise>UPPER_BOUND || noise<-UPPER_BOUND)
                 noise = UPPER_BOUND * (noise>0 ? 1:-1);
             counts[i] += noise;
         }
+
+        // a grid with fewer published than true records drops a random subset
+        // of them, chosen once here: the kept records are moved to the front
+        // of the grid, so every query and every restart drops the same ones
+        std::random_device rd;
+        std::default_random_engine rng(rd());
+        Points_t& points = *points_ptr;
+        for (size_t gid=0; gid<counts.size(); ++gid) {
+            const size_t true_count = get_index_true_count(gid);
+            const size_t kept_count = std::abs(counts[gid]);
+            if (kept_count >= true_count)
+                continue;
+            for (size_t i=0; i<kept_count; ++i) {
+                std::uniform_int_distribution<size_t> pick(i, true_count-1);
+                points.swap(offsets[gid]+i, offsets[gid]+pick(rng));
+            }
+        }
+    }
+
+    // make the index adaptive: perturb the level-1 count of each grid with
+    // epsilon, and split the grid into S by S leaves, with S chosen so that a
+    // leaf holds about points_per_leaf points of the noisy count
+    void split_dense_grids(float epsilon, size_t max_split, size_t points_per_leaf, size_t num_threads=0) {
+        const size_t num_of_grids = ipow(K, dim);
+        if (max_split == 0 || max_split > MAX_GRID_SPLIT)
+            max_split = MAX_GRID_SPLIT;
+        if (points_per_leaf == 0)
+            points_per_leaf = std::max<size_t>(1, num_of_points / num_of_grids);
+        if (num_threads == 0)
+            num_threads = std::max(1u, std::thread::hardware_concurrency());
+        num_threads = std::min(num_threads, num_of_grids);
+
+        // step1. level-1 counts, the budget is split evenly among the grids
+        // as in perturb_index_counts
+        const double UPPER_BOUND = 1e3;
+        float grid_epsilon = epsilon / num_of_grids;
+        std::vector<size_t> cell_offsets(num_of_grids + 1);
+        for (size_t c=0; c<=num_of_grids; ++c) {
+            cell_offsets[c] = offsets[leaf_begin[c]];
+        }
+        grid_counts.resize(num_of_grids);
+        for (size_t c=0; c<num_of_grids; ++c) {
+            double noise = LaplaceMechanism(1.0, grid_epsilon);
+            if (noise>UPPER_BOUND || noise<-UPPER_BOUND)
+                noise = UPPER_BOUND * (noise>0 ? 1:-1);
+            grid_counts[c] = (cell_offsets[c+1] - cell_offsets[c]) + noise;
+        }
+
+        // step2. the splits are chosen from the noisy counts only
+        for (size_t c=0; c<num_of_grids; ++c) {
+            double ratio = std::max(0, grid_counts[c]) / (double)points_per_leaf;
+            splits[c] = std::min<size_t>(max_split, std::max<size_t>(1, std::ceil(std::sqrt(ratio))));
+            leaf_begin[c+1] = leaf_begin[c] + splits[c] * splits[c];
+        }
+
+        // step3. reorder the points of each grid by leaf, the grids are split among the threads
+        const size_t num_of_leaves = leaf_begin[num_of_grids];
+        std::vector<size_t> leaf_offsets(num_of_leaves + 1, 0);
+        Points_t& points = *points_ptr;
+        ParallelRun(num_threads, [&](const size_t t) {
+            for (size_t c=num_of_grids*t/num_threads; c<num_of_grids*(t+1)/num_threads; ++c) {
+                const size_t begin = cell_offsets[c], end = cell_offsets[c+1];
+                const size_t n_leaves = splits[c] * splits[c];
+                std::vector<size_t> sub_offsets(n_leaves + 1, 0);
+                for (size_t i=begin; i<end; ++i) {
+                    ++sub_offsets[compute_leaf(c, points.x(i), points.y(i)) + 1];
+                }
+                sub_offsets[0] = begin;
+                for (size_t l=0; l<n_leaves; ++l) {
+                    sub_offsets[l+1] += sub_offsets[l];
+                }
+                // in-place counting sort, every swap moves one point to its final leaf
+                std::copy(sub_offsets.begin(), sub_offsets.end() - 1, leaf_offsets.begin() + leaf_begin[c]);
+                std::vector<size_t> cursors(sub_offsets.begin(), sub_offsets.end() - 1);
+                for (size_t l=0; l<n_leaves; ++l) {
+                    while (cursors[l] < sub_offsets[l+1]) {
+                        size_t pl = compute_leaf(c, points.x(cursors[l]), points.y(cursors[l]));
+                        if (pl == l)
+                            ++cursors[l];
+                        else
+                            points.swap(cursors[l], cursors[pl]++);
+                    }
+                }
+            }
+        });
+        leaf_offsets[num_of_leaves] = num_of_points;
+        offsets.swap(leaf_offsets);
+
+        // step4. the true counts and boxes of the leaves
+        counts.resize(num_of_leaves);
+        for (size_t gid=0; gid<num_of_leaves; ++gid) {
+            counts[gid] = offsets[gid+1] - offsets[gid];
+        }
+        compute_leaf_boxes(num_threads);
+
+        std::cout << "Split Grid: " << num_of_leaves << " leaves in " << num_of_grids << " grids" << std::endl;
+    }
+
+    // split_dense_grids with SPLIT_EPSILON_SHARE of epsilon, then
+    // perturb_index_counts of the leaves with the rest
+    void perturb_adaptive_index_counts(float epsilon, size_t max_split, size_t points_per_leaf) {
+        split_dense_grids(epsilon * SPLIT_EPSILON_SHARE, max_split, points_per_leaf);
+        perturb_index_counts(epsilon * (1 - SPLIT_EPSILON_SHARE));
     }
 
     COUNT_TYPE get_index_perturb_count(const size_t gid) {
@@ -104,15 +344,13 @@ public:
     }
 
     COUNT_TYPE get_index_true_count(const size_t gid) {
-        return buckets[gid].size();
+        return offsets[gid+1] - offsets[gid];
     }
 
+    // the points of grid gid are points[offsets[gid], offsets[gid+1]) of the store
     void get_index_record(const size_t gid, std::vector<Record_t>& data) {
         data.clear();
-        for (size_t pid : buckets[gid])  {
-            Point_t point = (*points_ptr)[pid];
-            data.emplace_back(point);
-        }
+        points_ptr->materialize(offsets[gid], offsets[gid+1], data);
     }
 
     void publish_index_counts(std::vector<size_t>& _cnts) {
@@ -121,61 +359,180 @@ public:
             _cnts.emplace_back(cnt);
     }
 
-    Points_t range_query(ICDE18::Circle_t& circ) {
-        auto start = std::chrono::steady_clock::now();
+    // the leaves per side of each grid and the level-1 counts, both empty
+    // unless the index is adaptive
+    void publish_index_splits(std::vector<size_t>& _splits, std::vector<size_t>& _grid_counts) {
+        _splits.clear();
+        _grid_counts.clear();
+        if (grid_counts.empty())
+            return;
+        _splits.insert(_splits.end(), splits.begin(), splits.end());
+        for (auto cnt : grid_counts)
+            _grid_counts.emplace_back(cnt);
+    }
 
-        // transform the circle into a rectangle box
-        Point_t min_corner, max_corner;
-        min_corner.x = circ.x - circ.rad;
-        min_corner.y = circ.y - circ.rad;
-        max_corner.x = circ.x + circ.rad;
-        max_corner.y = circ.y + circ.rad;
+    // the points inside range, where range is a Circle_t, Rectangle_t, Circle or Rectangle.
+    // Grids fully inside the range are accepted without per-point tests, the
+    // others are scanned with the SIMD filters and only the matches are materialized.
+    template<typename Range_t>
+    void range_query(const Range_t& range, std::vector<Record_t>& result) {
+        result.clear();
+        for_each_candidate_grid(range, [&](const size_t gid, const bool inside) {
+            if (inside) {
+                points_ptr->materialize(offsets[gid], offsets[gid+1], result);
+                return;
+            }
+            const uint32_t* idx;
+            size_t m = filter_grid(range, gid, idx);
+            points_ptr->materialize(offsets[gid], idx, m, result);
+        });
+    }
 
-        // bucket ranges that intersect the query box
-        std::vector<Range> ranges;
+    template<typename Range_t>
+    std::vector<Record_t> range_query(const Range_t& range) {
+        std::vector<Record_t> result;
+        range_query(range, result);
+        return result;
+    }
 
-        // search range on the 1-st dimension
-        ranges.emplace_back(std::make_pair(get_dim_idx(min_corner, 0), get_dim_idx(max_corner, 0)));
-        
-        // find all intersect ranges
-        for (size_t i=1; i<dim; ++i) {
-            auto start_idx = get_dim_idx(min_corner, i);
-            auto end_idx = get_dim_idx(max_corner, i);
-
-            std::vector<Range> temp_ranges;
-            for (auto idx=start_idx; idx<=end_idx; ++idx) {
-                for (size_t j=0; j<ranges.size(); ++j) {
-                    temp_ranges.emplace_back(std::make_pair(ranges[j].first + idx*dim_offset[i], ranges[j].second + idx*dim_offset[i]));
-                }
+    // the number of points inside range
+    template<typename Range_t>
+    size_t range_count(const Range_t& range) {
+        size_t result = 0;
+        for_each_candidate_grid(range, [&](const size_t gid, const bool inside) {
+            if (inside) {
+                result += offsets[gid+1] - offsets[gid];
+                return;
             }
+            const uint32_t* idx;
+            result += filter_grid(range, gid, idx);
+        });
+        return result;
+    }
 
-            // update the range vector
-            ranges = temp_ranges;
+    // write the built and perturbed index to fileName, and its points in their
+    // grid order to fileName.points, tagged with the epoch of the published counts
+    //
+    // Both files are written aside and renamed into place, the points first.
+    // The old index is removed before its points are replaced, so a crash
+    // leaves either a consistent snapshot or no index, which is rebuilt.
+    void save_snapshot(const std::string& fileName, const int64_t epoch) const {
+        const std::string tmpName = fileName + ".tmp";
+        const std::string pointsName = fileName + ".points";
+        points_ptr->write_file(pointsName + ".tmp", K);
+
+        FILE* fp = fopen(tmpName.c_str(), "wb");
+        if (fp == NULL) {
+            printf("Failed to open %s\n", tmpName.c_str());
+            exit(-1);
         }
 
-        // Points candidates;
-        Points_t result;
+        SnapshotHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+        header.version = SNAPSHOT_VERSION;
+        header.num_of_dims = dim;
+        header.K = K;
+        header.num_of_points = num_of_points;
+        header.epoch = epoch;
+        header.adaptive = !grid_counts.empty();
+
+        bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+        ok = ok && write_array(fp, mins.data(), dim);
+        ok = ok && write_array(fp, maxs.data(), dim);
+        ok = ok && write_array(fp, widths.data(), dim);
+        ok = ok && write_array(fp, splits.data(), splits.size());
+        ok = ok && write_array(fp, grid_counts.data(), grid_counts.size());
+        ok = ok && write_array(fp, offsets.data(), offsets.size());
+        ok = ok && write_array(fp, counts.data(), counts.size());
+        ok = ok && write_array(fp, grid_mins.data(), grid_mins.size());
+        ok = ok && write_array(fp, grid_maxs.data(), grid_maxs.size());
+        ok = ok && fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+        if (fclose(fp) != 0 || !ok) {
+            printf("Failed to write %s\n", tmpName.c_str());
+            exit(-1);
+        }
 
-        // find candidate points
-        for (auto range : ranges) {
-            size_t start_idx = range.first;
-            size_t end_idx = range.second;
+        if ((remove(fileName.c_str()) != 0 && errno != ENOENT) ||
+            rename((pointsName + ".tmp").c_str(), pointsName.c_str()) != 0 ||
+            rename(tmpName.c_str(), fileName.c_str()) != 0) {
+            printf("Failed to replace %s\n", fileName.c_str());
+            exit(-1);
+        }
+    }
 
-            for (size_t idx=start_idx; idx<=end_idx; ++idx) {
-                for (auto cand_idx : this->buckets[idx]) {
-                    Point_t p = (*points_ptr)[cand_idx];
-                    if (IntersectWithRange(p, circ)) {
-                        result.emplace_back(p);
-                    }
-                }
+    // load a snapshot written by save_snapshot, the points are mapped, not read.
+    // Returns nullptr if there is no snapshot at fileName.
+    static std::unique_ptr<GridIndex> load_snapshot(const std::string& fileName, int64_t& epoch) {
+        FILE* fp = fopen(fileName.c_str(), "rb");
+        if (fp == NULL) {
+            return nullptr;
+        }
+
+        std::unique_ptr<GridIndex> ret(new GridIndex());
+        SnapshotHeader header;
+        bool ok = fread(&header, sizeof(header), 1, fp) == 1 &&
+                  memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) == 0 &&
+                  header.version == SNAPSHOT_VERSION && header.num_of_dims == dim &&
+                  header.K > 0 && header.K <= MAX_GRID_NUM_PER_SIDE;
+        const size_t num_of_grids = ok ? ipow(header.K, dim) : 0;
+        if (ok) {
+            ret->K = header.K;
+            ret->num_of_points = header.num_of_points;
+            ret->splits.resize(num_of_grids);
+            ret->grid_counts.resize(header.adaptive ? num_of_grids : 0);
+            ok = read_array(fp, ret->mins.data(), dim) &&
+                 read_array(fp, ret->maxs.data(), dim) &&
+                 read_array(fp, ret->widths.data(), dim) &&
+                 read_array(fp, ret->splits.data(), ret->splits.size()) &&
+                 read_array(fp, ret->grid_counts.data(), ret->grid_counts.size());
+        }
+        if (ok) {
+            ret->leaf_begin.resize(num_of_grids + 1);
+            ret->leaf_begin[0] = 0;
+            for (size_t c=0; c<num_of_grids && ok; ++c) {
+                ok = ret->splits[c] >= 1 && ret->splits[c] <= MAX_GRID_SPLIT;
+                ret->leaf_begin[c+1] = ret->leaf_begin[c] + ret->splits[c] * ret->splits[c];
             }
         }
+        if (ok) {
+            const size_t num_of_leaves = ret->leaf_begin[num_of_grids];
+            ret->offsets.resize(num_of_leaves + 1);
+            ret->counts.resize(num_of_leaves);
+            ret->grid_mins.resize(num_of_leaves);
+            ret->grid_maxs.resize(num_of_leaves);
+            ok = read_array(fp, ret->offsets.data(), ret->offsets.size()) &&
+                 read_array(fp, ret->counts.data(), ret->counts.size()) &&
+                 read_array(fp, ret->grid_mins.data(), ret->grid_mins.size()) &&
+                 read_array(fp, ret->grid_maxs.data(), ret->grid_maxs.size());
+        }
+        fclose(fp);
+
+        // the leaves must cover the points in order, every record read goes through them
+        ok = ok && ret->offsets.front() == 0 && ret->offsets.back() == ret->num_of_points &&
+             std::is_sorted(ret->offsets.begin(), ret->offsets.end());
+        if (ok) {
+            ret->points_ptr = std::make_shared<Points_t>();
+            ret->points_ptr->map_file(fileName + ".points");
+            ok = ret->points_ptr->size() == ret->num_of_points;
+        }
+        if (!ok) {
+            printf("Failed to parse the index snapshot %s\n", fileName.c_str());
+            exit(-1);
+        }
 
-        auto end = std::chrono::steady_clock::now();
-        range_time += std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
-        range_count ++;
-        
-        return result;
+        for (size_t i=0; i<dim; ++i) {
+            ret->dim_offset[i] = ipow(ret->K, i);
+        }
+        epoch = header.epoch;
+
+        std::cout << "Load Grid K=" << ret->K << " with " << ret->counts.size() << " leaves from " << fileName << std::endl;
+        return ret;
+    }
+
+    // the points of the index, in grid order
+    std::shared_ptr<Points_t> get_points() const {
+        return points_ptr;
     }
 
     size_t GetK() {
@@ -205,11 +562,13 @@ public:
         size_t ret = 0;
         
         ret += sizeof(num_of_points);                                    // num_of_points;
-        ret += sizeof(points_ptr);                                       // points_ptr;
-        ret += this->buckets.size() * sizeof(std::vector<size_t>);       // buckets
-        for (auto bucket : buckets)
-            ret += bucket.size() * sizeof(size_t);
-        ret += this->counts.size() * sizeof(size_t);                      // counts
+        ret += this->offsets.size() * sizeof(size_t);                    // offsets
+        ret += sizeof(points_ptr);                                       // points_ptr, shared with the silo
+        ret += this->counts.size() * sizeof(COUNT_TYPE);                 // counts
+        ret += this->counts.size() * 2 * dim * sizeof(float);            // grid_mins, grid_maxs
+        ret += this->splits.size() * sizeof(uint32_t);                   // splits
+        ret += this->leaf_begin.size() * sizeof(size_t);                 // leaf_begin
+        ret += this->grid_counts.size() * sizeof(COUNT_TYPE);            // grid_counts
         ret += dim * (3 * sizeof(float) + sizeof(size_t));              // others
 
         return ret;
@@ -217,42 +576,221 @@ public:
 
 
 private:
+    struct SnapshotHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t num_of_dims;
+        uint64_t K;
+        uint64_t num_of_points;
+        int64_t epoch;
+        // whether the level-1 counts follow the splits
+        uint32_t adaptive;
+        uint32_t reserved;
+    };
+
+    static constexpr char SNAPSHOT_MAGIC[8] = {'I', 'C', 'D', 'E', '1', '8', 'G', 'I'};
+    static constexpr uint32_t SNAPSHOT_VERSION = 2;
+
+    // only used by load_snapshot
+    GridIndex() {}
+
+    template<typename T>
+    static bool write_array(FILE* fp, const T* data, const size_t n) {
+        return fwrite(data, sizeof(T), n, fp) == n;
+    }
+
+    template<typename T>
+    static bool read_array(FILE* fp, T* data, const size_t n) {
+        return fread(data, sizeof(T), n, fp) == n;
+    }
+
     float build_time = 0;
-    float range_time = 0;
-    size_t range_count = 0;
+    size_t K;
     size_t num_of_points;
+    // CSR layout: the points reordered by leaf id, and the start of each leaf
     std::shared_ptr<Points_t> points_ptr;
-    std::array<std::vector<size_t>, ipow(K, dim)> buckets;
-    std::array<COUNT_TYPE, ipow(K, dim)> counts;
+    std::vector<size_t> offsets;
+    // the published, perturbed count of each leaf
+    std::vector<COUNT_TYPE> counts;
+    // grid c is split into splits[c] by splits[c] leaves, with the leaf ids
+    // [leaf_begin[c], leaf_begin[c+1])
+    std::vector<uint32_t> splits;
+    std::vector<size_t> leaf_begin;
+    // the perturbed level-1 count of each grid, empty unless the index is adaptive
+    std::vector<COUNT_TYPE> grid_counts;
+    // the bounding box of the points in each leaf, tighter than the leaf itself
+    std::vector<std::array<float, dim>> grid_mins;
+    std::vector<std::array<float, dim>> grid_maxs;
     std::array<float, dim> mins;
     std::array<float, dim> maxs;
     std::array<float, dim> widths;
     std::array<size_t, dim> dim_offset;
 
-    // compute the index on d-th dimension of a given point
-    inline size_t get_dim_idx(const Point_t& p, const size_t& d) {
-        float pd = (d==0) ? p.x : p.y;
-
+    // compute the index on d-th dimension of a given coordinate
+    inline size_t get_dim_idx(const float pd, const size_t& d) {
         if (pd <= mins[d]) {
             return 0;
         } else if (pd >= maxs[d]) {
             return K-1;
         } else {
-            return (size_t) ((pd - mins[d]) / widths[d]);
+            // the quotient may round up to K just below maxs[d]
+            return std::min(K-1, (size_t) ((pd - mins[d]) / widths[d]));
         }
     }
 
+    // the bounding box of each range type
+    static void get_range_box(const Circle_t& range, float lo[2], float hi[2]) {
+        lo[0] = range.x - range.rad; hi[0] = range.x + range.rad;
+        lo[1] = range.y - range.rad; hi[1] = range.y + range.rad;
+    }
+
+    static void get_range_box(const Rectangle_t& range, float lo[2], float hi[2]) {
+        lo[0] = range.x - range.dx; hi[0] = range.x + range.dx;
+        lo[1] = range.y - range.dy; hi[1] = range.y + range.dy;
+    }
+
+    static void get_range_box(const Circle& range, float lo[2], float hi[2]) {
+        lo[0] = range.center().x() - range.rad(); hi[0] = range.center().x() + range.rad();
+        lo[1] = range.center().y() - range.rad(); hi[1] = range.center().y() + range.rad();
+    }
+
+    static void get_range_box(const Rectangle& range, float lo[2], float hi[2]) {
+        lo[0] = range.lo().x(); hi[0] = range.hi().x();
+        lo[1] = range.lo().y(); hi[1] = range.hi().y();
+    }
+
+    // call f(gid, inside) for each non-empty grid that may intersect range,
+    // inside tells whether all points of the grid are in the range
+    template<typename Range_t, typename Func_t>
+    void for_each_candidate_grid(const Range_t& range, Func_t f) {
+        static_assert(dim == 2, "ranges are two-dimensional");
+        float lo[2], hi[2];
+        get_range_box(range, lo, hi);
+
+        // widen the box by a few ulps, so no point accepted by the
+        // per-point test is lost by the rounding of the box
+        for (size_t d=0; d<dim; ++d) {
+            float slack = 1e-6f * std::max({std::abs(lo[d]), std::abs(hi[d]), 1.0f});
+            lo[d] -= slack;
+            hi[d] += slack;
+        }
+        if (lo[0] > maxs[0] || hi[0] < mins[0] || lo[1] > maxs[1] || hi[1] < mins[1])
+            return;
+
+        auto visit_leaf = [&](const size_t gid) {
+            if (offsets[gid] == offsets[gid+1])
+                return;
+
+            const std::array<float, dim>& g_lo = grid_mins[gid];
+            const std::array<float, dim>& g_hi = grid_maxs[gid];
+            if (g_lo[0] > hi[0] || g_hi[0] < lo[0] || g_lo[1] > hi[1] || g_hi[1] < lo[1])
+                return;
+
+            // the predicates are monotone in |p - center| along each axis,
+            // so a box whose corners are inside has all its points inside
+            const bool inside = IntersectWithRange(Point_t(-1, g_lo[0], g_lo[1]), range) &&
+                                IntersectWithRange(Point_t(-1, g_lo[0], g_hi[1]), range) &&
+                                IntersectWithRange(Point_t(-1, g_hi[0], g_lo[1]), range) &&
+                                IntersectWithRange(Point_t(-1, g_hi[0], g_hi[1]), range);
+            f(gid, inside);
+        };
+
+        for (size_t iy=get_dim_idx(lo[1], 1), ey=get_dim_idx(hi[1], 1); iy<=ey; ++iy) {
+            for (size_t ix=get_dim_idx(lo[0], 0), ex=get_dim_idx(hi[0], 0); ix<=ex; ++ix) {
+                const size_t c = ix*dim_offset[0] + iy*dim_offset[1];
+                const size_t S = splits[c];
+                if (S == 1) {
+                    visit_leaf(leaf_begin[c]);
+                    continue;
+                }
+                // the leaves of the grid that overlap the box
+                for (size_t sy=get_sub_idx(c, lo[1], 1), ty=get_sub_idx(c, hi[1], 1); sy<=ty; ++sy) {
+                    for (size_t sx=get_sub_idx(c, lo[0], 0), tx=get_sub_idx(c, hi[0], 0); sx<=tx; ++sx) {
+                        visit_leaf(leaf_begin[c] + sy*S + sx);
+                    }
+                }
+            }
+        }
+    }
+
+    // the leaf index on d-th dimension of a coordinate within grid c, the
+    // leaves of c split its extent mins[d]+i*widths[d] evenly
+    inline size_t get_sub_idx(const size_t c, const float pd, const size_t d) {
+        const size_t S = splits[c];
+        const size_t i = (c / dim_offset[d]) % K;
+        const float lo = mins[d] + i * widths[d];
+        const float sub_width = widths[d] / S;
+        if (pd <= lo || !(sub_width > 0))
+            return 0;
+        return std::min(S-1, (size_t) ((pd - lo) / sub_width));
+    }
+
+    // the leaf of a point of grid c, relative to leaf_begin[c]
+    inline size_t compute_leaf(const size_t c, const float x, const float y) {
+        return get_sub_idx(c, y, 1) * splits[c] + get_sub_idx(c, x, 0);
+    }
+
+    // the tight bounding box of each leaf, the leaves are split among the threads
+    void compute_leaf_boxes(const size_t num_threads) {
+        const size_t num_of_leaves = offsets.size() - 1;
+        const Points_t& points = *points_ptr;
+        grid_mins.resize(num_of_leaves);
+        grid_maxs.resize(num_of_leaves);
+        ParallelRun(num_threads, [&](const size_t t) {
+            for (size_t gid=num_of_leaves*t/num_threads; gid<num_of_leaves*(t+1)/num_threads; ++gid) {
+                grid_mins[gid].fill(std::numeric_limits<float>::max());
+                grid_maxs[gid].fill(std::numeric_limits<float>::lowest());
+                for (size_t i=offsets[gid]; i<offsets[gid+1]; ++i) {
+                    for (size_t d=0; d<dim; ++d) {
+                        float value = (d==0) ? points.x(i) : points.y(i);
+                        grid_mins[gid][d] = std::min(value, grid_mins[gid][d]);
+                        grid_maxs[gid][d] = std::max(value, grid_maxs[gid][d]);
+                    }
+                }
+            }
+        });
+    }
+
     // compute the bucket ID of a given point
-    inline size_t compute_id(const Point_t& p) {
+    inline size_t compute_id(const float x, const float y) {
         size_t id = 0;
 
         for (size_t i=0; i<dim; ++i) {
-            size_t current_idx = get_dim_idx(p, i);
+            size_t current_idx = get_dim_idx((i==0) ? x : y, i);
             id += current_idx * dim_offset[i];
         }
 
         return id;
     }
+
+    // the SIMD filter of each range type over n points, bit-identical to IntersectWithRange
+    static size_t filter_range(const Circle_t& range, const float* xs, const float* ys, size_t n, uint32_t* idx) {
+        return FILTER::FilterCircle(xs, ys, n, range.x, range.y, range.rad, idx);
+    }
+
+    static size_t filter_range(const Rectangle_t& range, const float* xs, const float* ys, size_t n, uint32_t* idx) {
+        return FILTER::FilterRectangle(xs, ys, n, range.x, range.y, range.dx, range.dy, idx);
+    }
+
+    static size_t filter_range(const Circle& range, const float* xs, const float* ys, size_t n, uint32_t* idx) {
+        return FILTER::FilterCircle(xs, ys, n, range.center().x(), range.center().y(), range.rad(), idx);
+    }
+
+    static size_t filter_range(const Rectangle& range, const float* xs, const float* ys, size_t n, uint32_t* idx) {
+        return FILTER::FilterBox(xs, ys, n, range.lo().x(), range.lo().y(), range.hi().x(), range.hi().y(), idx);
+    }
+
+    // the offsets within grid gid of its points inside range, idx points to
+    // a per-thread buffer that is valid until the next call
+    template<typename Range_t>
+    size_t filter_grid(const Range_t& range, const size_t gid, const uint32_t*& idx) {
+        static thread_local std::vector<uint32_t> buffer;
+        const size_t begin = offsets[gid], n = offsets[gid+1] - offsets[gid];
+        if (buffer.size() < n)
+            buffer.resize(n);
+        idx = buffer.data();
+        return filter_range(range, points_ptr->x_data() + begin, points_ptr->y_data() + begin, n, buffer.data());
+    }
 };
 
 }
@@ -0,0 +1,280 @@
+#ifndef GRPC_COMMON_CPP_POINTS_H_
+#define GRPC_COMMON_CPP_POINTS_H_
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <string>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "global.h"
+
+namespace ICDE18 {
+
+// allocator of cache line aligned arrays, so the SIMD filters start on a full line
+template<typename T, size_t Align=64>
+struct AlignedAllocator {
+    using value_type = T;
+
+    template<typename U>
+    struct rebind { using other = AlignedAllocator<U, Align>; };
+
+    AlignedAllocator() = default;
+    template<typename U>
+    AlignedAllocator(const AlignedAllocator<U, Align>&) {}
+
+    T* allocate(size_t n) {
+        size_t bytes = (n * sizeof(T) + Align - 1) / Align * Align;
+        void* ptr = std::aligned_alloc(Align, bytes == 0 ? Align : bytes);
+        if (ptr == nullptr)
+            throw std::bad_alloc();
+        return static_cast<T*>(ptr);
+    }
+
+    void deallocate(T* ptr, size_t) {
+        std::free(ptr);
+    }
+
+    template<typename U>
+    bool operator==(const AlignedAllocator<U, Align>&) const { return true; }
+    template<typename U>
+    bool operator!=(const AlignedAllocator<U, Align>&) const { return false; }
+};
+
+// header of the binary point file
+//
+// The header is followed by the ID, x and y columns of the points, each one
+// starting on a 64-byte boundary, so the file can be mapped as a PointStore.
+// The values are stored in the byte order of the host.
+struct PointFileHeader {
+    char magic[8];
+    uint32_t version;
+    // K if the points are ordered by the grid ids of a K by K grid, otherwise 0
+    uint32_t grid_k;
+    uint64_t num_of_points;
+    uint64_t id_offset;
+    uint64_t x_offset;
+    uint64_t y_offset;
+    char reserved[16];
+};
+static_assert(sizeof(PointFileHeader) == 64, "the columns start on a cache line");
+
+constexpr char POINT_FILE_MAGIC[8] = {'I', 'C', 'D', 'E', '1', '8', 'P', 'T'};
+constexpr uint32_t POINT_FILE_VERSION = 1;
+
+// structure-of-arrays store of the records of a silo
+//
+// The coordinates and IDs live in separate aligned arrays, so a range scan
+// reads only the x and y arrays, and Record_t is materialized only for the
+// points that match. The arrays are either owned by the store or mapped
+// from a binary point file.
+class PointStore {
+public:
+    template<typename T>
+    using Array = std::vector<T, AlignedAllocator<T>>;
+
+    PointStore() {}
+
+    explicit PointStore(const std::vector<Record_t>& records) {
+        assign(records);
+    }
+
+    PointStore(const PointStore&) = delete;
+    PointStore& operator=(const PointStore&) = delete;
+
+    void assign(const std::vector<Record_t>& records) {
+        const size_t num_of_points = records.size();
+        mapping.reset();
+        xs.resize(num_of_points);
+        ys.resize(num_of_points);
+        ids.resize(num_of_points);
+        for (size_t i=0; i<num_of_points; ++i) {
+            ids[i] = records[i].ID;
+            xs[i] = records[i].x;
+            ys[i] = records[i].y;
+        }
+        set_columns(ids.data(), xs.data(), ys.data(), num_of_points);
+        file_grid_k = 0;
+    }
+
+    // take over the given columns, e.g. after the points were reordered
+    void assign(Array<int>&& _ids, Array<float>&& _xs, Array<float>&& _ys) {
+        mapping.reset();
+        ids = std::move(_ids);
+        xs = std::move(_xs);
+        ys = std::move(_ys);
+        set_columns(ids.data(), xs.data(), ys.data(), ids.size());
+        file_grid_k = 0;
+    }
+
+    // map a binary point file, the pages are loaded on first touch so the
+    // silo can start serving before the whole file is read
+    void map_file(const std::string& fileName) {
+        int fd = open(fileName.c_str(), O_RDONLY);
+        if (fd < 0) {
+            printf("Failed to open %s\n", fileName.c_str());
+            abort();
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(PointFileHeader)) {
+            printf("Failed to parse the point file %s\n", fileName.c_str());
+            abort();
+        }
+        const size_t file_size = st.st_size;
+        // private mapping: the grid may reorder the points without writing the file
+        void* addr = mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (addr == MAP_FAILED) {
+            printf("Failed to map %s\n", fileName.c_str());
+            abort();
+        }
+        mapping = std::shared_ptr<void>(addr, [file_size](void* ptr) { munmap(ptr, file_size); });
+
+        const PointFileHeader& header = *static_cast<const PointFileHeader*>(addr);
+        static_assert(sizeof(float) == sizeof(int), "the columns have the same width");
+        if (memcmp(header.magic, POINT_FILE_MAGIC, sizeof(header.magic)) != 0 ||
+            header.version != POINT_FILE_VERSION ||
+            header.num_of_points > file_size / sizeof(float) ||
+            !valid_column(header.id_offset, header.num_of_points * sizeof(float), file_size) ||
+            !valid_column(header.x_offset, header.num_of_points * sizeof(float), file_size) ||
+            !valid_column(header.y_offset, header.num_of_points * sizeof(float), file_size)) {
+            printf("Failed to parse the point file %s\n", fileName.c_str());
+            abort();
+        }
+        const size_t num_of_points = header.num_of_points;
+
+        char* base = static_cast<char*>(addr);
+        xs.clear();
+        ys.clear();
+        ids.clear();
+        set_columns(reinterpret_cast<int*>(base + header.id_offset),
+                    reinterpret_cast<float*>(base + header.x_offset),
+                    reinterpret_cast<float*>(base + header.y_offset), num_of_points);
+        file_grid_k = header.grid_k;
+    }
+
+    // write the store as a binary point file, grid_k is recorded if the
+    // points are ordered by the grid ids of a grid_k by grid_k grid
+    void write_file(const std::string& fileName, const uint32_t grid_k=0) const {
+        FILE* fp = fopen(fileName.c_str(), "wb");
+        if (fp == NULL) {
+            printf("Failed to open %s\n", fileName.c_str());
+            abort();
+        }
+
+        const size_t column_size = size() * sizeof(float);
+        const size_t column_stride = (column_size + 63) / 64 * 64;
+        PointFileHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, POINT_FILE_MAGIC, sizeof(header.magic));
+        header.version = POINT_FILE_VERSION;
+        header.grid_k = grid_k;
+        header.num_of_points = size();
+        header.id_offset = sizeof(header);
+        header.x_offset = header.id_offset + column_stride;
+        header.y_offset = header.x_offset + column_stride;
+
+        static const char padding[64] = {0};
+        bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+        for (const void* column : {(const void*)pid, (const void*)px, (const void*)py}) {
+            ok = ok && fwrite(column, 1, column_size, fp) == column_size;
+            ok = ok && fwrite(padding, 1, column_stride - column_size, fp) == column_stride - column_size;
+        }
+        ok = ok && fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+        if (fclose(fp) != 0 || !ok) {
+            printf("Failed to write %s\n", fileName.c_str());
+            abort();
+        }
+    }
+
+    size_t size() const {
+        return n;
+    }
+
+    bool empty() const {
+        return n == 0;
+    }
+
+    // the grid_k recorded in the mapped file, 0 if the points are not known to be ordered
+    size_t grid_k() const {
+        return file_grid_k;
+    }
+
+    float x(size_t i) const { return px[i]; }
+    float y(size_t i) const { return py[i]; }
+    int id(size_t i) const { return pid[i]; }
+
+    const float* x_data() const { return px; }
+    const float* y_data() const { return py; }
+    const int* id_data() const { return pid; }
+
+    void swap(size_t i, size_t j) {
+        std::swap(px[i], px[j]);
+        std::swap(py[i], py[j]);
+        std::swap(pid[i], pid[j]);
+    }
+
+    Record_t get(size_t i) const {
+        return Record_t(pid[i], px[i], py[i]);
+    }
+
+    // append the records of [begin, end)
+    void materialize(size_t begin, size_t end, std::vector<Record_t>& out) const {
+        out.reserve(out.size() + (end - begin));
+        for (size_t i=begin; i<end; ++i) {
+            out.emplace_back(pid[i], px[i], py[i]);
+        }
+    }
+
+    // append the records of base+idx[0], ..., base+idx[m-1]
+    void materialize(size_t base, const uint32_t* idx, size_t m, std::vector<Record_t>& out) const {
+        out.reserve(out.size() + m);
+        for (size_t i=0; i<m; ++i) {
+            const size_t j = base + idx[i];
+            out.emplace_back(pid[j], px[j], py[j]);
+        }
+    }
+
+    size_t memory_size() const {
+        return size() * (2 * sizeof(float) + sizeof(int));
+    }
+
+private:
+    // a column of column_size bytes at offset lies within the file and is
+    // aligned for float and int, the header values are not trusted
+    static bool valid_column(const uint64_t offset, const size_t column_size, const size_t file_size) {
+        return offset % alignof(float) == 0 && offset % alignof(int) == 0 &&
+               offset <= file_size && column_size <= file_size - offset;
+    }
+
+    void set_columns(int* _ids, float* _xs, float* _ys, size_t _n) {
+        pid = _ids;
+        px = _xs;
+        py = _ys;
+        n = _n;
+    }
+
+    // owned columns, empty when the store is mapped
+    Array<float> xs;
+    Array<float> ys;
+    Array<int> ids;
+    // the mapped file, if any
+    std::shared_ptr<void> mapping;
+    float* px = nullptr;
+    float* py = nullptr;
+    int* pid = nullptr;
+    size_t n = 0;
+    size_t file_grid_k = 0;
+};
+
+}
+
+#endif // GRPC_COMMON_CPP_POINTS_H_
@@ -1,11 +1,20 @@
 #include <algorithm>
+#include <atomic>
+#include <charconv>
 #include <chrono>
+#include <cfloat>
 #include <cmath>
+#include <condition_variable>
 #include <iostream>
 #include <iomanip>
+#include <deque>
+#include <functional>
+#include <future>
 #include <memory>
 #include <mutex>
 #include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <string>
 
 
@@ -19,6 +28,8 @@
 #include "differentialprivacy.h"
 #include "ICDE18.grpc.pb.h"
 #include "AES.h"
+#include "filter.h"
+#include "threadpool.hpp"
 
 #define ENCRYPT_RECORD
 
@@ -43,13 +54,19 @@ using ICDE18::Point;
 using ICDE18::Rectangle;
 using ICDE18::Circle;
 using ICDE18::CircleQueryRange;
+using ICDE18::FedQueryCoordinator;
 using ICDE18::RectangleQueryRange;
 using ICDE18::Record;
+using ICDE18::RecordBatch;
 using ICDE18::EncryptRecord;
+using ICDE18::EncryptRecordChunk;
+using ICDE18::FetchRequest;
 using ICDE18::IntVector;
 using ICDE18::FloatVector;
 using ICDE18::ByteVector;
 using ICDE18::GridIndexCounts;
+using ICDE18::GridFilter;
+using ICDE18::GridFilterBatch;
 using ICDE18::RecordSummary;
 using ICDE18::FedQueryService;
 using ICDE18::QueryLogger;
@@ -92,7 +109,82 @@ RectangleQueryRange MakeRectangleQueryRange(float x, float y, float dx, float dy
   return ret;
 }
 
+// the decrypted records of one streamed chunk, in columns, so the
+// verification filters them where they are
+struct GridRecordColumns {
+  std::vector<int> ids;
+  std::vector<float> xs, ys;
+  // the records with ID >= 0, the others are dummies
+  size_t num_of_real = 0;
+
+  size_t size() const {
+    return ids.size();
+  }
+
+  void clear() {
+    ids.clear();
+    xs.clear();
+    ys.clear();
+    num_of_real = 0;
+  }
+};
+
+// the verified records of a batch of queries, merged from the chunks of
+// every silo as soon as each one is verified
+struct BatchResult {
+  // record_lists[j]: the true records inside query j
+  std::vector<std::vector<Record_t>> record_lists;
+  // record_fps[j]: the true records received for query j
+  std::vector<size_t> record_fps;
+  // expected_records[j]: the published counts of the grids of query j, summed
+  // over the silos, the record list is reserved for them up front
+  std::vector<size_t> expected_records;
+  // if set, the records of each verified chunk are queued in forwarded as
+  // (j, records) for the thread that answers the client, instead of being
+  // kept in record_lists
+  bool forward = false;
+  std::deque<std::pair<int, std::vector<Record_t>>> forwarded;
+  // the first error of the silo calls, the batch fails as a whole
+  Status status;
+  // the contexts of the silo calls in flight, cancelled when the batch fails
+  std::unordered_set<ClientContext*> contexts;
+  std::atomic<bool> cancelled{false};
+  // the silo calls not completed yet
+  size_t active_calls = 0;
+  std::mutex mutex;
+  // notified when records are forwarded or a silo call completes
+  std::condition_variable cond;
+
+  explicit BatchResult(const size_t batch_size) :
+    record_lists(batch_size), record_fps(batch_size, 0), expected_records(batch_size, 0) {}
+
+  // record the error and stop the silo calls in flight, called with mutex held
+  void Fail(const Status& error) {
+    if (status.ok())
+      status = error;
+    if (cancelled)
+      return;
+    cancelled = true;
+    for (ClientContext* context : contexts) {
+      context->TryCancel();
+    }
+  }
+};
+
+// the chunks waiting to be verified, per verify thread, before the stream
+// readers are held back
+constexpr size_t VERIFY_QUEUE_CHUNKS_PER_THREAD = 4;
+
+// how often a client query that waits for records checks that its client is still there
+constexpr int CLIENT_POLL_INTERVAL_MS = 100;
+
 class ServerToSilo {
+#ifdef ENCRYPT_RECORD
+using FilterGridMessage = EncryptRecordChunk;
+#else
+using FilterGridMessage = RecordBatch;
+#endif
+
 public:
   ServerToSilo(std::shared_ptr<grpc::Channel> channel, const int id, const std::string& _IPAddress) : stub_(FedQueryService::NewStub(channel)) {
     serverID = id;
@@ -113,7 +205,7 @@ public:
     fflush(stdout);
   }
 
-  void GetLocalRecord(std::vector<ICDE18::Record>& res) {
+  void GetLocalRecord(std::vector<Record_t>& res) {
     res = m_record_list;
   }
 
@@ -121,8 +213,9 @@ public:
     log.SetStartTimer();
 
     Rectangle rect = MakeRectangle(_rect.x, _rect.y, _rect.dx, _rect.dy);
-    Record record;
+    RecordBatch batch;
     ClientContext context;
+    float batch_comm = 0;
 
     #ifdef LOCAL_DEBUG
     printf("Looking for data records between (%.2f, %.2f) and (%.2f, %.2f)\n",
@@ -130,13 +223,23 @@ public:
     fflush(stdout);
     #endif
 
-    std::unique_ptr<ClientReader<Record> > reader(
+    SetDeadline(context);
+    std::unique_ptr<ClientReader<RecordBatch> > reader(
         stub_->AnswerRectangleRangeQuery(&context, rect));
     m_record_list.clear();
-    while (reader->Read(&record)) {
-      m_record_list.emplace_back(record);
+    bool malformed = false;
+    while (reader->Read(&batch)) {
+      batch_comm += batch.ByteSizeLong();
+      if (!ICDE18::AppendRecordBatch(batch, m_record_list)) {
+        // stop the stream, the call fails below
+        malformed = true;
+        context.TryCancel();
+        break;
+      }
     }
     Status status = reader->Finish();
+    if (malformed)
+      status = Status(grpc::StatusCode::DATA_LOSS, "malformed record batch");
     if (status.ok()) {
       #ifdef LOCAL_DEBUG
       printf("gRPC [AnswerRectangleRangeQuery] succeeded.\n");
@@ -149,18 +252,14 @@ public:
     }
 
     log.SetEndTimer();
-    queryComm += CommQueryAnswer(m_record_list);
-    log.LogOneQuery(CommQueryAnswer(m_record_list));
+    queryComm += batch_comm;
+    log.LogOneQuery(batch_comm);
 
     #ifdef LOCAL_DEBUG
     printf("There are %d objects in the query range:\n", (int)m_record_list.size());
     for (auto record : m_record_list) {
-      if (record.has_p()) {
-        printf("  ID = %d, location = (%.2f,%.2f)\n", 
-                record.id(), record.p().x(), record.p().y());
-      } else {
-        printf("Data silo returns incomplete record.\n");
-      }
+      printf("  ID = %d, location = (%.2f,%.2f)\n", 
+              record.ID, record.x, record.y);
     }
     fflush(stdout);
     #endif
@@ -172,8 +271,9 @@ public:
     log.SetStartTimer();
 
     Circle circ = MakeCircle(_circ.x, _circ.y, _circ.rad);
-    Record record;
+    RecordBatch batch;
     ClientContext context;
+    float batch_comm = 0;
 
     #ifdef LOCAL_DEBUG
     printf("Looking for data records within center(%.2f, %.2f) and radius %.2f\n",
@@ -181,13 +281,23 @@ public:
     fflush(stdout);
     #endif
 
-    std::unique_ptr<ClientReader<Record> > reader(
+    SetDeadline(context);
+    std::unique_ptr<ClientReader<RecordBatch> > reader(
         stub_->AnswerCircleRangeQuery(&context, circ));
     m_record_list.clear();
-    while (reader->Read(&record)) {
-      m_record_list.emplace_back(record);
+    bool malformed = false;
+    while (reader->Read(&batch)) {
+      batch_comm += batch.ByteSizeLong();
+      if (!ICDE18::AppendRecordBatch(batch, m_record_list)) {
+        // stop the stream, the call fails below
+        malformed = true;
+        context.TryCancel();
+        break;
+      }
     }
     Status status = reader->Finish();
+    if (malformed)
+      status = Status(grpc::StatusCode::DATA_LOSS, "malformed record batch");
     if (status.ok()) {
       #ifdef LOCAL_DEBUG
       printf("gRPC [AnswerCircleRangeQuery] succeeded.\n");
@@ -202,18 +312,14 @@ public:
     }
 
     log.SetEndTimer();
-    queryComm += CommQueryAnswer(m_record_list);
-    log.LogOneQuery(CommQueryAnswer(m_record_list));
+    queryComm += batch_comm;
+    log.LogOneQuery(batch_comm);
 
     #ifdef LOCAL_DEBUG
     printf("There are %d objects in the query range:\n", (int)m_record_list.size());
     for (auto record : m_record_list) {
-      if (record.has_p()) {
-        printf("  ID = %d, location = (%.2f,%.2f)\n", 
-                record.id(), record.p().x(), record.p().y());
-      } else {
-        printf("Data silo returns incomplete record.\n");
-      }
+      printf("  ID = %d, location = (%.2f,%.2f)\n", 
+              record.ID, record.x, record.y);
     }
     fflush(stdout);
     #endif
@@ -221,11 +327,13 @@ public:
     return true;
   }
 
-  void GetGridIndex() {
+  // called with m_index_mutex held, returns the communication cost
+  float GetGridIndex() {
     ClientContext context;
     Empty request;
     GridIndexCounts response;
   
+    SetDeadline(context);
     Status status = stub_->GetGridIndex(&context, request, &response); 
     if (status.ok()) {
       #ifdef LOCAL_DEBUG
@@ -240,19 +348,51 @@ public:
       exit(-1);
     }
 
-    queryComm += response.ByteSizeLong();
-    log.LogAddComm(response.ByteSizeLong());
-    
+    if (!SetGridIndex(response))
+      exit(-1);
+
+    return response.ByteSizeLong();
+  }
+
+  // cache the grid index of a GetGridIndex response, called with m_index_mutex
+  // held. The cached index is kept if the response is inconsistent.
+  bool SetGridIndex(const GridIndexCounts& response) {
+    // the leaves of each grid, a grid that is not split is its own leaf
+    const size_t num_of_grids = (size_t)response.k() * response.k();
+    std::vector<size_t> splits(num_of_grids, 1);
+    if (response.splits().values_size() == (int)num_of_grids) {
+      ICDE18::CopyToVector<size_t>(splits, response.splits());
+    }
+    std::vector<size_t> leaf_begin(num_of_grids + 1);
+    leaf_begin[0] = 0;
+    for (size_t i=0; i<num_of_grids; ++i) {
+      leaf_begin[i+1] = leaf_begin[i] + splits[i] * splits[i];
+    }
+    const size_t num_of_counts = response.counts().values_size();
+    if (leaf_begin[num_of_grids] != num_of_counts || response.mins().values_size() < 2 || 
+        response.maxs().values_size() < 2 || response.widths().values_size() < 2) {
+      printf("Silo %d sent an inconsistent grid index, %zu counts for %zu leaves.\n", serverID+1, num_of_counts, leaf_begin[num_of_grids]);
+      fflush(stdout);
+      return false;
+    }
+
     m_K = response.k();
+    m_epoch = response.epoch();
+    m_has_grid_index = true;
     ICDE18::CopyToVector<float>(m_mins, response.mins());
     ICDE18::CopyToVector<float>(m_maxs, response.maxs());
     ICDE18::CopyToVector<float>(m_widths, response.widths());
     ICDE18::CopyToVector<size_t>(m_counts, response.counts());
+    m_splits.swap(splits);
+    m_leaf_begin.swap(leaf_begin);
+    for (size_t d=0; d<2; ++d) {
+      m_slack[d] = 4 * FLT_EPSILON * (std::fabs(m_mins[d]) + std::fabs(m_maxs[d]));
+    }
 
     #ifdef LOCAL_DEBUG
     size_t sum_counts = 0;
     for (auto cnt : m_counts) sum_counts += cnt;
-    printf("There are %d grid in the grid index (K = %d): %d\n", (int)m_counts.size(), m_K, (int)sum_counts);
+    printf("There are %d leaves in the grid index (K = %d): %d\n", (int)m_counts.size(), m_K, (int)sum_counts);
     for (int i=0,sz=m_counts.size(); i<sz; ++i) {
       if (i == 0)
         printf("  %d", (int)m_counts[i]);
@@ -262,228 +402,746 @@ public:
     putchar('\n');
     fflush(stdout);
     #endif
+
+    return true;
   }
 
-  void SendFilterGridIndex(const Circle_t& _circ) {
-    ClientContext context;
-    IntVector request;
-    Empty response;
-    size_t request_sz = 0;
+  // one round-trip per batch of queries: send the filtered grids of every query
+  // and stream back their records. The records are verified against the
+  // verify_circs and merged into result while the stream goes on.
+  //
+  // The stream is driven by the completion queue cq, so one thread can serve
+  // many calls in flight. Every received chunk is handed to verify_pool to be
+  // decrypted and verified, whose bounded queue holds the reader back when
+  // the workers fall behind. The call object deletes itself when the stream is
+  // finished and its last chunk is verified, and the future holds the
+  // communication cost of the call.
+  std::future<float> AsyncFilterGridRecord(const std::vector<Circle_t>& circs, 
+                                           const std::vector<Circle_t>& verify_circs,
+                                           BatchResult& result, ICDE18::ThreadPool* verify_pool,
+                                           grpc::CompletionQueue* cq) {
+    AsyncFilterGridCall* call = new AsyncFilterGridCall(this, circs, verify_circs, result, verify_pool, cq);
+    return call->Start();
+  }
 
-    for (size_t i=0, sz=m_counts.size(); i<sz; ++i) {
-      if (!this->GridIntersectCircle(i, _circ))
-        continue;
-      // check whether the grid intersects with the circle range
-      if (m_counts[i] != 0) {
-        ++request_sz;
-        request.add_values(i);
+  // the state of one AsyncFilterGridRecord, used as the completion queue tag
+  class AsyncFilterGridCall {
+  public:
+    AsyncFilterGridCall(ServerToSilo* _silo, const std::vector<Circle_t>& _circs, 
+                        const std::vector<Circle_t>& _verify_circs, BatchResult& _result,
+                        ICDE18::ThreadPool* _verify_pool, grpc::CompletionQueue* _cq) : 
+                        silo(_silo), circs(_circs), verify_circs(_verify_circs), result(_result),
+                        verify_pool(_verify_pool), cq(_cq) {}
+
+    std::future<float> Start() {
+      std::future<float> ret = promise.get_future();
+      {
+        std::lock_guard<std::mutex> lock(result.mutex);
+        ++result.active_calls;
+      }
+      comm += silo->PrepareGridFilter(circs, request);
+      StartCall();
+      return ret;
+    }
+
+    // called by the completion queue loop for every event of this call
+    void Proceed(bool ok) {
+      switch (state) {
+      case CALL_READ:
+        if (ok) {
+          // the records of one grid, shared by the queries that filtered it
+          comm += message.ByteSizeLong();
+          {
+            std::lock_guard<std::mutex> lock(call_mutex);
+            ++pending_chunks;
+          }
+          auto chunk = std::make_shared<FilterGridMessage>(std::move(message));
+          message.Clear();
+          verify_pool->Submit([this, chunk]() { VerifyChunk(*chunk); });
+        }
+        // fall through
+      case CALL_START:
+        if (ok) {
+          state = CALL_READ;
+          reader->Read(&message, this);
+        } else {
+          state = CALL_FINISH;
+          reader->Finish(&status, this);
+        }
+        break;
+      case CALL_FINISH:
+        if (status.error_code() == grpc::StatusCode::FAILED_PRECONDITION && !retried) {
+          // the silo has published a new grid index since we cached it,
+          // unless another query has fetched it already
+          retried = true;
+          if (silo->RefilterGridFilter(circs, request))
+            StartCall();
+          else
+            StartRefresh();
+          break;
+        }
+        FinishStream();
+        break;
+      case CALL_REFRESH:
+        // the new grid index is fetched without blocking the completion queue
+        if (status.ok()) {
+          comm += index_response.ByteSizeLong();
+          if (silo->RefreshGridFilter(circs, index_response, request)) {
+            StartCall();
+            break;
+          }
+          status = Status(grpc::StatusCode::DATA_LOSS, "inconsistent grid index");
+        }
+        FinishStream();
+        break;
       }
     }
-    request.set_size(request_sz);
 
-    Status status = stub_->SendFilterGridIndex(&context, request, &response); 
-    if (status.ok()) {
-      #ifdef LOCAL_DEBUG
-      printf("gRPC [SendFilterGridIndex] succeeded.\n");
-      fflush(stdout);
-      #endif
-    } else {
+  private:
+    enum CallState { CALL_START, CALL_READ, CALL_FINISH, CALL_REFRESH };
+
+    void StartCall() {
+      if (!ResetContext()) {
+        // the batch has failed, the retry is not sent
+        status = Status(grpc::StatusCode::CANCELLED, "the batch was cancelled");
+        FinishStream();
+        return;
+      }
+      ClassifyGridFilter();
+      request.set_chunk_size(silo->m_chunk_size);
+      comm += request.ByteSizeLong();
+
+      state = CALL_START;
+      reader = silo->PrepareAsyncFilterGridStream(context.get(), request, cq);
+      reader->StartCall(this);
+    }
+
+    void StartRefresh() {
+      if (!ResetContext()) {
+        status = Status(grpc::StatusCode::CANCELLED, "the batch was cancelled");
+        FinishStream();
+        return;
+      }
+
       #ifdef LOCAL_DEBUG
-      printf("gRPC [SendFilterGridIndex] failed.\n");
+      printf("gRPC [FilterGridRecord] stale epoch %lld, refresh the grid index.\n", (long long)request.epoch());
       fflush(stdout);
       #endif
-      exit(-1);
+      state = CALL_REFRESH;
+      index_reader = silo->PrepareAsyncGetGridIndex(context.get(), index_request, cq);
+      index_reader->StartCall();
+      index_reader->Finish(&index_response, &status, this);
     }
 
-    queryComm += request.ByteSizeLong();
-    log.LogAddComm(request.ByteSizeLong());
-  }
+    // a new context for the next call to the silo, registered with the batch
+    // so a failure cancels it. Returns false if the batch has failed already.
+    bool ResetContext() {
+      auto next = std::make_unique<ClientContext>();
+      silo->SetDeadline(*next);
+
+      std::lock_guard<std::mutex> lock(result.mutex);
+      if (context)
+        result.contexts.erase(context.get());
+      context = std::move(next);
+      if (result.cancelled)
+        return false;
+      result.contexts.insert(context.get());
+      return true;
+    }
+
+    // the stream is finished, complete now unless chunks are still being verified
+    void FinishStream() {
+      {
+        std::lock_guard<std::mutex> lock(call_mutex);
+        stream_done = true;
+        if (pending_chunks > 0)
+          return;
+      }
+      Complete();
+    }
+
+    // map every filtered grid to the queries that filtered it, and whether it
+    // is fully inside them. A stale request fails before any chunk is
+    // streamed, so a retry starts from an empty result.
+    // The counts of a retry replace those of the stale request in the result.
+    void ClassifyGridFilter() {
+      grid_queries.clear();
+      size_t expected = 0;
+      std::vector<size_t> previous_records(request.grid_ids_size(), 0);
+      previous_records.swap(expected_records);
+      for (int i=0; i<request.grid_ids_size(); ++i) {
+        const IntVector& grid_ids = request.grid_ids(i);
+        std::vector<bool> inside = silo->GetInsideLeaves(request.epoch(), grid_ids, verify_circs[i], expected);
+        expected_records[i] = expected;
+        for (int j=0; j<grid_ids.values_size(); ++j) {
+          grid_queries[grid_ids.values(j)].emplace_back(i, inside[j]);
+        }
+      }
+
+      std::lock_guard<std::mutex> lock(result.mutex);
+      if (result.forward)
+        return;
+      for (size_t i=0; i<expected_records.size(); ++i) {
+        result.expected_records[i] -= previous_records[i];
+        result.expected_records[i] += expected_records[i];
+        result.record_lists[i].reserve(result.expected_records[i]);
+      }
+    }
+
+    // run by the verify pool while more chunks stream in. Whatever happens
+    // to the chunk, it is counted as done, so the call always completes.
+    void VerifyChunk(const FilterGridMessage& chunk) {
+      try {
+        if (!result.cancelled)
+          VerifyChunkRecords(chunk);
+      } catch (const std::exception& e) {
+        printf("Failed to verify a chunk of silo %d: %s\n", silo->serverID+1, e.what());
+        fflush(stdout);
+        std::lock_guard<std::mutex> lock(result.mutex);
+        result.Fail(Status(grpc::StatusCode::INTERNAL, e.what()));
+      }
+
+      bool completed = false;
+      {
+        std::lock_guard<std::mutex> lock(call_mutex);
+        --pending_chunks;
+        ++verified_chunks;
+        completed = stream_done && pending_chunks == 0;
+      }
+      if (completed)
+        Complete();
+    }
+
+    // decrypt one chunk and verify it for every query that filtered its grid,
+    // a malformed chunk fails the batch
+    void VerifyChunkRecords(const FilterGridMessage& chunk) {
+      thread_local GridRecordColumns grid;
+      thread_local std::vector<uint32_t> idx;
+      thread_local std::vector<std::vector<Record_t>> survivors;
+
+      grid.clear();
+      if (!silo->AppendFilterGridMessage(chunk, grid)) {
+        std::lock_guard<std::mutex> lock(result.mutex);
+        result.Fail(Status(grpc::StatusCode::DATA_LOSS, "malformed record chunk"));
+        return;
+      }
+      auto iter = grid_queries.find(chunk.grid_id());
+      if (iter != grid_queries.end()) {
+        const auto& queries = iter->second;
+        if (survivors.size() < queries.size())
+          survivors.resize(queries.size());
+        for (size_t k=0; k<queries.size(); ++k) {
+          survivors[k].clear();
+          VerifyGridRecord(verify_circs[queries[k].first], grid, queries[k].second, idx, survivors[k]);
+        }
+
+        // merge into the result of the batch, or queue it to be forwarded, once per chunk
+        std::lock_guard<std::mutex> lock(result.mutex);
+        for (size_t k=0; k<queries.size(); ++k) {
+          const int query = queries[k].first;
+          if (result.forward) {
+            if (!survivors[k].empty())
+              result.forwarded.emplace_back(query, std::move(survivors[k]));
+          } else {
+            result.record_lists[query].insert(result.record_lists[query].end(), survivors[k].begin(), survivors[k].end());
+          }
+          result.record_fps[query] += grid.num_of_real;
+        }
+        if (result.forward)
+          result.cond.notify_all();
+      }
+    }
+
+    // the stream is finished and every chunk is verified, a failed stream fails the batch
+    void Complete() {
+      silo->FinishFilterGridRecord(status, verified_chunks, comm);
+      {
+        std::lock_guard<std::mutex> lock(result.mutex);
+        if (!status.ok())
+          result.Fail(status);
+        result.contexts.erase(context.get());
+        --result.active_calls;
+        result.cond.notify_all();
+      }
+      promise.set_value(comm);
+      delete this;
+    }
+
+    ServerToSilo* silo;
+    std::vector<Circle_t> circs;
+    std::vector<Circle_t> verify_circs;
+    BatchResult& result;
+    ICDE18::ThreadPool* verify_pool;
+    // grid_queries[gid]: the queries that filtered the grid, and whether it is inside them
+    std::unordered_map<int, std::vector<std::pair<int, bool>>> grid_queries;
+    // expected_records[j]: the published counts of the grids that query j filtered at this silo
+    std::vector<size_t> expected_records;
+    std::mutex call_mutex;
+    size_t pending_chunks = 0;
+    size_t verified_chunks = 0;
+    bool stream_done = false;
+    grpc::CompletionQueue* cq;
+    std::unique_ptr<ClientContext> context;
+    std::unique_ptr<grpc::ClientAsyncReader<FilterGridMessage> > reader;
+    std::unique_ptr<grpc::ClientAsyncResponseReader<GridIndexCounts> > index_reader;
+    Empty index_request;
+    GridIndexCounts index_response;
+    GridFilterBatch request;
+    FilterGridMessage message;
+    Status status;
+    CallState state = CALL_START;
+    bool retried = false;
+    float comm = 0;
+    std::promise<float> promise;
+  };
 
   float GetQueryComm() {
     return this->queryComm;
   }
 
-  size_t GetRecordFP() {
-    return this->m_record_fp;
-  }
-
   void InitQueryComm(float init_value = 0.0f) {
     queryComm = init_value;
   }
 
-  void GetFilterGridRecord() {
-    m_record_list.clear();
+  void SetChunkSize(size_t chunk_size) {
+    m_chunk_size = chunk_size;
+  }
 
-    Record cand_record;
-    ClientContext context;
-    Empty request;
+  // the deadline of every call to the silo, 0 means no deadline
+  void SetRpcTimeout(size_t rpc_timeout_ms) {
+    m_rpc_timeout_ms = rpc_timeout_ms;
+  }
 
-    #ifdef LOCAL_DEBUG
-    printf("gRPC [GetFilterGridRecord] start.\n");
-    fflush(stdout);
-    #endif
+  // append the true records of grid inside circ to res_record_list, and
+  // return the number of true records in grid.
+  //
+  // The records are filtered in their columns, idx is the scratch of the
+  // SIMD filter. The dummies lie far outside any query and fail the filter,
+  // the records of a grid fully inside circ are copied without a distance check.
+  static size_t VerifyGridRecord(const Circle_t& circ, const GridRecordColumns& grid, const bool inside,
+                                 std::vector<uint32_t>& idx, std::vector<Record_t>& res_record_list) {
+    const size_t n = grid.size();
+    if (inside) {
+      for (size_t i=0; i<n; ++i) {
+        if (grid.ids[i] >= 0)
+          res_record_list.emplace_back(grid.ids[i], grid.xs[i], grid.ys[i]);
+      }
+      return grid.num_of_real;
+    }
 
-    #ifdef ENCRYPT_RECORD
-    // step 1: get the decrypted keys
+    if (idx.size() < n)
+      idx.resize(n);
+    size_t m = FILTER::FilterCircle(grid.xs.data(), grid.ys.data(), n, circ.x, circ.y, circ.rad, idx.data());
+    for (size_t i=0; i<m; ++i) {
+      const uint32_t k = idx[i];
+      if (grid.ids[k] >= 0)
+        res_record_list.emplace_back(grid.ids[k], grid.xs[k], grid.ys[k]);
+    }
+    return grid.num_of_real;
+  }
+
+  enum class CellRelation { OUTSIDE, INTERSECT, INSIDE };
+
+  // for each leaf of grid_ids, whether it is fully inside circ under the grid
+  // index of epoch, all false if the index has changed since.
+  // expected_records receives the sum of their published counts.
+  std::vector<bool> GetInsideLeaves(const int64_t epoch, const IntVector& grid_ids, const Circle_t& circ,
+                                    size_t& expected_records) {
+    std::lock_guard<std::mutex> lock(m_index_mutex);
+    std::vector<bool> inside(grid_ids.values_size(), false);
+    expected_records = 0;
+    if (epoch != m_epoch)
+      return inside;
+    for (int j=0; j<grid_ids.values_size(); ++j) {
+      const size_t gid = grid_ids.values(j);
+      if (gid >= m_counts.size())
+        continue;
+      expected_records += m_counts[gid];
+      const size_t i = std::upper_bound(m_leaf_begin.begin(), m_leaf_begin.end(), gid) - m_leaf_begin.begin() - 1;
+      inside[j] = ClassifyLeaf(i, gid - m_leaf_begin[i], circ) == CellRelation::INSIDE;
+    }
+    return inside;
+  }
+
+private:
+  #ifdef ENCRYPT_RECORD
+  // the keys of a silo never change, so they are fetched once per connection
+  float GetEncryptKeys() {
+    ClientContext context;
+    Empty request;
     ByteVector response;
-    ClientContext context_tmp;
 
-    Status status = stub_->GetEncryptKeys(&context_tmp, request, &response); 
+    SetDeadline(context);
+    Status status = stub_->GetEncryptKeys(&context, request, &response); 
     if (!status.ok()) {
       exit(-1);
     }
 
-    queryComm += response.ByteSizeLong();
-    log.LogAddComm(response.ByteSizeLong());
-
-    const int n_keys = response.size();
     const std::string& received_key_data = response.values();  
     std::vector<unsigned char> decrypt_keys(received_key_data.begin(), received_key_data.end());  
-    
-    // std::cout << n_keys << " " << decrypt_keys.size() << std::endl;
-    // for (int i=0; i<decrypt_keys.size(); ++i) {
-    //   std::cout << std::hex << std::uppercase; // 设置为十六进制，并输出为大写字母  
-    //   std::cout << std::setw(2) << std::setfill('0'); // 设置宽度为2，不足时前面用'0'填充  
-    //   std::cout << static_cast<int>(decrypt_keys[i]) << " ";
-    // }
-    // std::cout << std::endl;
-    // fflush(stdout);
+    m_aes.SetKey(decrypt_keys);
 
-    // step 2: get the encrypted records
-    AES aes(AESKeyLength::AES_256);
-    EncryptRecord encrypt_record;
-
-    std::unique_ptr<ClientReader<EncryptRecord> > reader(
-        stub_->GetFilterGridEncryptRecord(&context, request));
-    while (reader->Read(&encrypt_record)) {
-      // step 2.1: get encrypted bytes
-      const std::string& received_record_data = encrypt_record.data();  
-      std::vector<unsigned char> encrypt_record_data(received_record_data.begin(), received_record_data.end());  
-      // step 2.2: get decrypted bytes
-      std::vector<unsigned char> record_data = aes.DecryptECB(encrypt_record_data, decrypt_keys);
-      // step 2.3: get decrypted record
-      Record_t rec = ICDE18::DeserializeRecord(record_data);
-      // step 2.4: transform record_t into record
-      cand_record = MakeRecord(rec);
-      m_record_list.emplace_back(cand_record);
-    }
-    status = reader->Finish();
-    if (!status.ok()) {
-      exit(-1);
-    }
-    queryComm += encrypt_record.ByteSizeLong() * m_record_list.size();
-    log.LogAddComm(encrypt_record.ByteSizeLong() * m_record_list.size());
+    return response.ByteSizeLong();
+  }
+  #endif
+
+  void SetDeadline(ClientContext& context) {
+    if (m_rpc_timeout_ms > 0)
+      context.set_deadline(system_clock::now() + std::chrono::milliseconds(m_rpc_timeout_ms));
+  }
+
+  // filter with the cached grid index, fetched on first use
+  float PrepareGridFilter(const std::vector<Circle_t>& circs, GridFilterBatch& request) {
+    std::lock_guard<std::mutex> lock(m_index_mutex);
+    float comm = 0;
+
+    if (!m_has_grid_index)
+      comm += GetGridIndex();
+    #ifdef ENCRYPT_RECORD
+    if (!m_aes.HasKey())
+      comm += GetEncryptKeys();
+    #endif
+    MakeGridFilter(circs, request);
+
+    return comm;
+  }
+
+  // filter again after the silo rejected the epoch of request, if another
+  // query has refreshed the grid index since. False if it is as stale as request.
+  bool RefilterGridFilter(const std::vector<Circle_t>& circs, GridFilterBatch& request) {
+    std::lock_guard<std::mutex> lock(m_index_mutex);
+    if (m_epoch == request.epoch())
+      return false;
+    MakeGridFilter(circs, request);
+    return true;
+  }
 
+  // cache the grid index fetched after the silo rejected the epoch of request,
+  // and filter again. False if the fetched index is inconsistent.
+  bool RefreshGridFilter(const std::vector<Circle_t>& circs, const GridIndexCounts& response, GridFilterBatch& request) {
+    std::lock_guard<std::mutex> lock(m_index_mutex);
+    // another query may have refreshed it already
+    if (m_epoch == request.epoch() && !SetGridIndex(response))
+      return false;
+    MakeGridFilter(circs, request);
+    return true;
+  }
+
+  std::unique_ptr<grpc::ClientAsyncResponseReader<GridIndexCounts> > PrepareAsyncGetGridIndex(
+      ClientContext* context, const Empty& request, grpc::CompletionQueue* cq) {
+    return stub_->PrepareAsyncGetGridIndex(context, request, cq);
+  }
+
+  std::unique_ptr<grpc::ClientAsyncReader<FilterGridMessage> > PrepareAsyncFilterGridStream(
+      ClientContext* context, const GridFilterBatch& request, grpc::CompletionQueue* cq) {
+    #ifdef ENCRYPT_RECORD
+    return stub_->PrepareAsyncFilterGridEncryptChunkBatch(context, request, cq);
     #else
-    
-    std::unique_ptr<ClientReader<Record> > reader(
-        stub_->GetFilterGridRecord(&context, request));
-    while (reader->Read(&cand_record)) {
-      m_record_list.emplace_back(cand_record);
+    return stub_->PrepareAsyncFilterGridRecordBatch(context, request, cq);
+    #endif
+  }
+
+  // append the records of a received chunk to grid, false if it is malformed
+  #ifdef ENCRYPT_RECORD
+  bool AppendFilterGridMessage(const EncryptRecordChunk& chunk, GridRecordColumns& grid) {
+    // step1. get encrypted bytes
+    const std::string& received_chunk_data = chunk.data();  
+    const size_t n_records = chunk.size();
+    const size_t n_bytes = n_records * ICDE18::RECORD_BLOCK_SIZE;
+    if (received_chunk_data.size() != n_bytes) {
+      printf("Silo %d sent a chunk of %zu bytes for %zu records, expected %zu bytes\n",
+              serverID+1, received_chunk_data.size(), n_records, n_bytes);
+      fflush(stdout);
+      return false;
     }
-    Status status = reader->Finish();
+    // step2. decrypt the whole chunk in one pass
+    std::vector<unsigned char> record_data(n_bytes);
+    m_aes.DecryptBlocks(reinterpret_cast<const unsigned char*>(received_chunk_data.data()), 
+                        n_bytes, record_data.data());
+    // step3. get decrypted records, straight into the columns of the grid
+    size_t offset = grid.size();
+    grid.ids.resize(offset + n_records);
+    grid.xs.resize(offset + n_records);
+    grid.ys.resize(offset + n_records);
+    for (size_t i=0; i<n_records; ++i) {
+      Record_t record = ICDE18::DeserializeRecord(record_data.data() + i*ICDE18::RECORD_BLOCK_SIZE);
+      grid.ids[offset+i] = record.ID;
+      grid.xs[offset+i] = record.x;
+      grid.ys[offset+i] = record.y;
+      grid.num_of_real += (record.ID >= 0);
+    }
+    return true;
+  }
+  #else
+  bool AppendFilterGridMessage(const RecordBatch& batch, GridRecordColumns& grid) {
+    if (!ICDE18::CheckRecordBatch(batch)) {
+      printf("Silo %d sent a malformed record batch\n", serverID+1);
+      fflush(stdout);
+      return false;
+    }
+    grid.ids.insert(grid.ids.end(), batch.ids().begin(), batch.ids().end());
+    grid.xs.insert(grid.xs.end(), batch.xs().begin(), batch.xs().end());
+    grid.ys.insert(grid.ys.end(), batch.ys().begin(), batch.ys().end());
+    for (int id : batch.ids())
+      grid.num_of_real += (id >= 0);
+    return true;
+  }
+  #endif
+
+  void FinishFilterGridRecord(const Status& status, const size_t verified_chunks, const float comm) {
     if (status.ok()) {
       #ifdef LOCAL_DEBUG
-      printf("gRPC [GetFilterGridRecord] succeeded.\n");
+      printf("gRPC [FilterGridRecord] succeeded.\n");
       fflush(stdout);
       #endif
     } else {
       #ifdef LOCAL_DEBUG
-      printf("gRPC [GetFilterGridRecord] failed.\n");
+      printf("gRPC [FilterGridRecord] failed: %s\n", status.error_message().c_str());
       fflush(stdout);
       #endif
-      exit(-1);
     }
-    queryComm += CommQueryAnswer(m_record_list);
-    log.LogAddComm(CommQueryAnswer(m_record_list));
-    #endif
+    log.LogAddComm(comm);
 
     #ifdef LOCAL_DEBUG
-    printf("There are %d objects in the query range:\n", (int)m_record_list.size());
-    for (auto record : m_record_list) {
-      if (record.has_p()) {
-        printf("  ID = %d, location = (%.2f,%.2f)\n", 
-                record.id(), record.p().x(), record.p().y());
-      } else {
-        printf("Data silo returns incomplete record.\n");
-      }
-    }
+    printf("There are %zu chunks verified, comm=%.0f\n", verified_chunks, comm);
     fflush(stdout);
-
     #endif   
   }
 
-  void VerifyGridRecord(const Circle_t& circ, std::vector<ICDE18::Record>& res_record_list) {
-    res_record_list.clear();
-    m_record_fp = 0;
-    for (auto record : m_record_list) {
-      if (!record.has_p()) {
-        continue;
-      }
-      if (record.id() >= 0) {
-        ++m_record_fp;
-      }
-      ICDE18::Record_t record_tmp(-1, record.p().x(), record.p().y());
-      if (ICDE18::IntersectWithRange(record_tmp, circ)) {
-        if (record.id() >= 0)
-          res_record_list.emplace_back(record);
+  void MakeGridFilter(const std::vector<Circle_t>& circs, GridFilterBatch& request) {
+    request.clear_grid_ids();
+    for (const auto& circ : circs) {
+      MakeGridFilter(circ, request.add_grid_ids());
+    }
+    request.set_epoch(m_epoch);
+  }
+
+  // the ids of the non-empty leaves that intersect with the circle, only the
+  // grids and leaves within the bounding box of the circle are visited
+  void MakeGridFilter(const Circle_t& _circ, IntVector* grid_ids) {
+    size_t request_sz = 0;
+
+    grid_ids->clear_values();
+    size_t lo_ix, hi_ix, lo_iy, hi_iy;
+    GetGridRange(_circ, lo_ix, hi_ix, lo_iy, hi_iy);
+    for (size_t iy=lo_iy; iy<=hi_iy; ++iy) {
+      for (size_t ix=lo_ix; ix<=hi_ix; ++ix) {
+        const size_t i = iy * m_K + ix;
+        const size_t S = m_splits[i];
+        if (S > 1 && ClassifyGrid(i, _circ) == CellRelation::OUTSIDE)
+          continue;
+
+        size_t lo_sx, hi_sx, lo_sy, hi_sy;
+        GetLeafRange(i, _circ, lo_sx, hi_sx, lo_sy, hi_sy);
+        for (size_t sy=lo_sy; sy<=hi_sy; ++sy) {
+          for (size_t sx=lo_sx; sx<=hi_sx; ++sx) {
+            const size_t leaf = sy * S + sx;
+            const size_t gid = m_leaf_begin[i] + leaf;
+            if (m_counts[gid] == 0 || ClassifyLeaf(i, leaf, _circ) == CellRelation::OUTSIDE)
+              continue;
+            ++request_sz;
+            grid_ids->add_values(gid);
+          }
+        }
       }
     }
+    grid_ids->set_size(request_sz);
   }
 
-private:
-  Record MakeRecord(const Record_t& r) {
-      Record ret;
-      Point p;
-
-      ret.set_id(r.ID);
-      p.set_x(r.x);
-      p.set_y(r.y);
-      ret.mutable_p()->CopyFrom(p);
-      
-      return ret;
+  // the range of grid indexes on each side that the bounding box of circ
+  // overlaps, widened by one grid against the rounding of the silo
+  void GetGridRange(const Circle_t& circ, size_t& lo_ix, size_t& hi_ix, size_t& lo_iy, size_t& hi_iy) {
+    GetDimRange(circ.x - circ.rad, circ.x + circ.rad, m_mins[0], m_widths[0], m_K, lo_ix, hi_ix);
+    GetDimRange(circ.y - circ.rad, circ.y + circ.rad, m_mins[1], m_widths[1], m_K, lo_iy, hi_iy);
   }
 
-  bool GridIntersectCircle(const size_t& gid, const Circle_t& circ) {
-    size_t idx_x = gid % this->m_K;
-    size_t idx_y = gid / this->m_K;
+  // the same within the leaves of grid i
+  void GetLeafRange(const size_t i, const Circle_t& circ, size_t& lo_sx, size_t& hi_sx, size_t& lo_sy, size_t& hi_sy) {
+    const size_t S = m_splits[i];
+    float lo_x = m_mins[0] + (i % m_K) * m_widths[0];
+    float lo_y = m_mins[1] + (i / m_K) * m_widths[1];
+    GetDimRange(circ.x - circ.rad, circ.x + circ.rad, lo_x, m_widths[0] / S, S, lo_sx, hi_sx);
+    GetDimRange(circ.y - circ.rad, circ.y + circ.rad, lo_y, m_widths[1] / S, S, lo_sy, hi_sy);
+  }
 
-    float lo_x = m_mins[0] + idx_x * this->m_widths[0];
-    float hi_x = lo_x + this->m_widths[0];
-    float lo_y = m_mins[1] + idx_y * this->m_widths[1];
-    float hi_y = lo_y + this->m_widths[1];
+  static void GetDimRange(const float lo, const float hi, const float base, const float width, const size_t n,
+                          size_t& lo_idx, size_t& hi_idx) {
+    lo_idx = 0;
+    hi_idx = n - 1;
+    if (!(width > 0))
+      return;
+    double lo_pos = std::floor((lo - base) / width) - 1;
+    double hi_pos = std::floor((hi - base) / width) + 1;
+    lo_idx = (size_t) std::min<double>(n - 1, std::max<double>(0, lo_pos));
+    hi_idx = (size_t) std::min<double>(n - 1, std::max<double>(0, hi_pos));
+  }
 
-    // check if the circle center is inside the rectangle;
-    if (lo_x<=circ.x && circ.x<=hi_x && lo_y<=circ.y && circ.y<=hi_y) {
-      return true;
-    } 
+  CellRelation ClassifyGrid(const size_t i, const Circle_t& circ) {
+    float lo_x = m_mins[0] + (i % m_K) * m_widths[0];
+    float lo_y = m_mins[1] + (i / m_K) * m_widths[1];
+    return ClassifyBox(lo_x, lo_y, lo_x + m_widths[0], lo_y + m_widths[1], circ);
+  }
+
+  // the leaf-th leaf of grid i, row by row of splits[i] equal sub-grids
+  CellRelation ClassifyLeaf(const size_t i, const size_t leaf, const Circle_t& circ) {
+    const size_t S = m_splits[i];
+    float sub_width_x = m_widths[0] / S;
+    float sub_width_y = m_widths[1] / S;
+
+    float lo_x = m_mins[0] + (i % m_K) * m_widths[0] + (leaf % S) * sub_width_x;
+    float lo_y = m_mins[1] + (i / m_K) * m_widths[1] + (leaf / S) * sub_width_y;
+    return ClassifyBox(lo_x, lo_y, lo_x + sub_width_x, lo_y + sub_width_y, circ);
+  }
+
+  // The box is widened by m_slack, so it holds every record the silo put in
+  // it. Both tests are exact for the records of the box under the float
+  // distance of FILTER::FilterCircle, as |p - center| is monotone on each axis:
+  //   - INTERSECT: the closest point of the box to the center is inside
+  //   - INSIDE: the four corners of the box are inside
+  CellRelation ClassifyBox(float lo_x, float lo_y, float hi_x, float hi_y, const Circle_t& circ) {
+    lo_x -= m_slack[0]; hi_x += m_slack[0];
+    lo_y -= m_slack[1]; hi_y += m_slack[1];
 
-    // check if any corner of the rectangle is inside the circle
     const int temporal_record_id = -1;
-    if (ICDE18::IntersectWithRange(ICDE18::Record_t(temporal_record_id, lo_x, lo_y), circ) || 
-        ICDE18::IntersectWithRange(ICDE18::Record_t(temporal_record_id, lo_x, hi_y), circ) ||
-        ICDE18::IntersectWithRange(ICDE18::Record_t(temporal_record_id, hi_x, lo_y), circ) ||
+    float closest_x = std::min(std::max(circ.x, lo_x), hi_x);
+    float closest_y = std::min(std::max(circ.y, lo_y), hi_y);
+    if (!ICDE18::IntersectWithRange(ICDE18::Record_t(temporal_record_id, closest_x, closest_y), circ))
+      return CellRelation::OUTSIDE;
+
+    if (ICDE18::IntersectWithRange(ICDE18::Record_t(temporal_record_id, lo_x, lo_y), circ) && 
+        ICDE18::IntersectWithRange(ICDE18::Record_t(temporal_record_id, lo_x, hi_y), circ) &&
+        ICDE18::IntersectWithRange(ICDE18::Record_t(temporal_record_id, hi_x, lo_y), circ) &&
         ICDE18::IntersectWithRange(ICDE18::Record_t(temporal_record_id, hi_x, hi_y), circ) ) {
-      return true;
+      return CellRelation::INSIDE;
     }
 
-    return false;
+    return CellRelation::INTERSECT;
   }
 
   std::unique_ptr<FedQueryService::Stub> stub_;
-  std::vector<ICDE18::Record> m_record_list;
+  #ifdef ENCRYPT_RECORD
+  AES m_aes{AESKeyLength::AES_256};
+  #endif
+  std::vector<Record_t> m_record_list;
   std::vector<size_t> m_counts;
+  // the leaves per side of each grid, and the id of its first leaf
+  std::vector<size_t> m_splits, m_leaf_begin;
   std::vector<float> m_mins, m_maxs, m_widths;
+  // the rounding of a grid boundary on each side, see ClassifyBox
+  float m_slack[2] = {0, 0};
   QueryLogger log;
   int serverID, m_K;
-  size_t m_record_fp;
+  int64_t m_epoch = 0;
+  bool m_has_grid_index = false;
+  std::mutex m_index_mutex;
+  size_t m_chunk_size = ICDE18::DEFAULT_CHUNK_SIZE;
+  size_t m_rpc_timeout_ms = 0;
   std::string IPAddress;
   float queryComm = 0;
 };
 
+// the result file of a batch run, written through one large buffer
+//
+// "text" is the format of the server logs: the number of queries, then per
+// query a line "qid count record_fp" and the ids of the query on one line.
+// "binary" writes the int64 number of queries, then per query the int32 qid,
+// the int64 count and record_fp, and count int32 ids.
+// The ids are sorted only if sorted is set, in the order of arrival otherwise.
+class ResultWriter {
+public:
+  static constexpr size_t BUFFER_SIZE = 1 << 20;
+
+  ResultWriter(FILE* _fp, const std::string& _format="text", const bool _sorted=true) :
+    fp(_fp), binary(_format == "binary"), sorted(_sorted) {
+    if (_format != "text" && _format != "binary") {
+      printf("Unknown result format %s\n", _format.c_str());
+      exit(-1);
+    }
+    buffer.reserve(BUFFER_SIZE);
+  }
+
+  ~ResultWriter() {
+    Flush();
+  }
+
+  void Begin(const size_t num_of_queries) {
+    if (binary) {
+      int64_t n = num_of_queries;
+      Append(&n, sizeof(n));
+    } else {
+      AppendNumber(num_of_queries, '\n');
+    }
+  }
+
+  void Write(const int qid, const std::vector<Record_t>& record_list, const size_t record_fp) {
+    ids.clear();
+    ids.reserve(record_list.size());
+    for (const auto& record : record_list) {
+      ids.emplace_back(record.ID);
+    }
+    if (sorted)
+      std::sort(ids.begin(), ids.end());
+
+    if (binary) {
+      int32_t qid32 = qid;
+      int64_t header[2] = {(int64_t)ids.size(), (int64_t)record_fp};
+      Append(&qid32, sizeof(qid32));
+      Append(header, sizeof(header));
+      Append(ids.data(), ids.size() * sizeof(int32_t));
+      return;
+    }
+
+    AppendNumber(qid, ' ');
+    AppendNumber(ids.size(), ' ');
+    AppendNumber(record_fp, '\n');
+    for (size_t i=0; i<ids.size(); ++i) {
+      AppendNumber(ids[i], (i+1 == ids.size()) ? '\n' : ' ');
+    }
+    if (ids.empty())
+      Append("\n", 1);
+  }
+
+  void Flush() {
+    if (!buffer.empty()) {
+      fwrite(buffer.data(), 1, buffer.size(), fp);
+      buffer.clear();
+    }
+    fflush(fp);
+  }
+
+private:
+  void Append(const void* data, size_t n) {
+    if (buffer.size() + n > BUFFER_SIZE) {
+      fwrite(buffer.data(), 1, buffer.size(), fp);
+      buffer.clear();
+    }
+    if (n > BUFFER_SIZE) {
+      fwrite(data, 1, n, fp);
+      return;
+    }
+    const char* bytes = static_cast<const char*>(data);
+    buffer.insert(buffer.end(), bytes, bytes + n);
+  }
+
+  template<typename T>
+  void AppendNumber(const T value, const char separator) {
+    char str[24];
+    char* end = std::to_chars(str, str + sizeof(str) - 1, value).ptr;
+    *end++ = separator;
+    Append(str, end - str);
+  }
+
+  FILE* fp;
+  const bool binary;
+  const bool sorted;
+  std::vector<char> buffer;
+  std::vector<int32_t> ids;
+};
+
 class FedQueryServiceServer {
 public:
-  FedQueryServiceServer(const std::string& fileName) {
+  FedQueryServiceServer(const std::string& fileName, const size_t max_inflight=1, const size_t cq_threads=1,
+                        size_t verify_threads=0) {
     ICDE18::GetIPAddresses(fileName, m_IPAddresses);
     if (m_IPAddresses.empty()) {
       printf("%s contains no ip address\n", fileName.c_str());
@@ -503,7 +1161,47 @@ public:
       printf("[Connect] channel with Silo %d at ip %s\n", i+1, IPAddress.c_str());
       fflush(stdout);
     }  
-    m_GridIndexCounts.resize(m_IPAddresses.size());
+
+    // one worker per silo for the blocking calls,
+    // created once instead of per phase per query
+    m_pool = std::make_unique<ICDE18::ThreadPool>(m_ServerToSilos.size());
+
+    // the streamed chunks are decrypted and verified off the completion queue threads
+    if (verify_threads == 0)
+      verify_threads = std::max(1u, std::thread::hardware_concurrency());
+    m_verify_pool = std::make_unique<ICDE18::ThreadPool>(verify_threads, verify_threads * VERIFY_QUEUE_CHUNKS_PER_THREAD);
+
+    // a few threads drive the async calls of all queries in flight
+    m_max_inflight = std::max<size_t>(1, max_inflight);
+    for (size_t i=0; i<std::max<size_t>(1, cq_threads); ++i) {
+      m_cq_threads.emplace_back(&FedQueryServiceServer::AsyncCompleteRpc, this);
+    }
+  }
+
+  ~FedQueryServiceServer() {
+    m_cq.Shutdown();
+    for (auto& t : m_cq_threads) {
+      t.join();
+    }
+  }
+
+  // the maximum number of bytes of one streamed record chunk
+  void SetChunkSize(size_t chunk_size) {
+    for (auto& silo : m_ServerToSilos) {
+      silo->SetChunkSize(chunk_size);
+    }
+  }
+
+  // the deadline of every call to a silo, 0 means no deadline
+  void SetRpcTimeout(size_t rpc_timeout_ms) {
+    for (auto& silo : m_ServerToSilos) {
+      silo->SetRpcTimeout(rpc_timeout_ms);
+    }
+  }
+
+  // the number of queries sent to each silo in one request
+  void SetBatchSize(size_t batch_size) {
+    m_batch_size = std::max<size_t>(1, batch_size);
   }
 
   void SetCircleQuery(const std::string& fileName, std::vector<Circle_t>& circles) {
@@ -525,143 +1223,196 @@ public:
     log.Print();
   }
 
-  void GetQueryAnswer_byGridIndex(const std::string& fileName) {
+  // the result file of GetQueryAnswer_byGridIndex, stdout by default
+  void SetResultWriter(std::unique_ptr<ResultWriter> writer) {
+    m_result_writer = std::move(writer);
+  }
+
+  // false if a batch has failed, the results of the batches before it are written
+  bool GetQueryAnswer_byGridIndex(const std::string& fileName) {
     std::vector<Circle_t> circles;
 
     SetCircleQuery(fileName, circles);
-    printf("%zu\n", circles.size());
-    for (int i=0,sz=circles.size(); i<sz; ++i) {
-      m_GetQueryAnswer_byGridIndex(circles[i], i+1);
+    if (!m_result_writer)
+      m_result_writer = std::make_unique<ResultWriter>(stdout);
+    m_result_writer->Begin(circles.size());
+
+    // send m_batch_size queries per request, keep up to m_max_inflight
+    // requests in flight, and finish them in order. After a failed batch no
+    // more are sent, and the ones in flight are drained.
+    bool ok = true;
+    std::deque<std::unique_ptr<PendingBatch>> inflight;
+    for (int i=0,sz=circles.size(); i<sz && ok; i+=m_batch_size) {
+      if (inflight.size() >= m_max_inflight) {
+        ok = FinishBatch(*inflight.front());
+        inflight.pop_front();
+      }
+      std::vector<Circle_t> batch_circs;
+      std::vector<int> batch_qids;
+      for (int j=i; j<sz && j<i+m_batch_size; ++j) {
+        batch_circs.emplace_back(circles[j]);
+        batch_qids.emplace_back(j+1);
+      }
+      inflight.emplace_back(StartBatch(batch_circs, batch_qids));
+    }
+    while (!inflight.empty()) {
+      ok = FinishBatch(*inflight.front()) && ok;
+      inflight.pop_front();
     }
+    m_result_writer->Flush();
 
     log.Print();
-  }
-  
-private:
-  void _localRangeQuery(int siloID, const Circle_t& circ) {
-    m_ServerToSilos[siloID]->GetQueryAnswer(circ);
-  }
-
-  void _localGetGridIndex(int siloID) {
-    m_ServerToSilos[siloID]->GetGridIndex();
+    return ok;
   }
 
-  void _localSendFilterGridIndex(int siloID, const Circle_t& circ) {
-    m_ServerToSilos[siloID]->SendFilterGridIndex(circ);
-  }
-
-  void _localGetFilterGridRecord(int siloID) {
-     m_ServerToSilos[siloID]->GetFilterGridRecord();
-  }
-
-  void GetGridIndex() {
-    std::vector<std::thread> thread_list(m_ServerToSilos.size());
+  // answer one query for a client on the calling thread. write(records)
+  // receives the verified records as they are produced, and returns false
+  // once the client is gone, like is_cancelled(). The silo streams of the
+  // query are then cancelled.
+  //
+  // The verify threads only queue the records, so a slow client holds back
+  // its own query and no other.
+  Status StreamCircleQuery(const Circle_t& circ, const int qid,
+                           const std::function<bool(const std::vector<Record_t>&)>& write,
+                           const std::function<bool()>& is_cancelled) {
+    auto batch = StartBatch({circ}, {qid}, true);
+    BatchResult& result = *batch->result;
+
+    // the records queued after the client is gone are dropped
+    bool connected = true;
+    std::vector<Record_t> records;
+    while (true) {
+      bool has_records = false;
+      {
+        std::unique_lock<std::mutex> lock(result.mutex);
+        result.cond.wait_for(lock, std::chrono::milliseconds(CLIENT_POLL_INTERVAL_MS), [&result]() {
+          return !result.forwarded.empty() || result.active_calls == 0;
+        });
+        if (result.forwarded.empty() && result.active_calls == 0)
+          break;
+        if (!result.forwarded.empty()) {
+          records = std::move(result.forwarded.front().second);
+          result.forwarded.pop_front();
+          has_records = true;
+        }
+      }
 
-    for (int i=0; i<m_ServerToSilos.size(); ++i) {
-      thread_list[i] = std::thread(&FedQueryServiceServer::_localGetGridIndex, this, i);
+      if (connected && (is_cancelled() || (has_records && !write(records)))) {
+        connected = false;
+        std::lock_guard<std::mutex> lock(result.mutex);
+        result.Fail(Status(grpc::StatusCode::CANCELLED, "the client has disconnected"));
+      }
     }
-    for (int i=0; i<m_ServerToSilos.size(); ++i) {
-      thread_list[i].join();
+
+    float batch_comm = 0;
+    for (auto& silo_comm : batch->silo_comms) {
+      batch_comm += silo_comm.get();
     }
-  }
+    log.LogOneQuery(batch_comm, QueryLogger::GetElapsedTime(batch->startTime));
 
-  void SendFilterGridIndex(const Circle_t& circ) {
-    std::vector<std::thread> thread_list(m_ServerToSilos.size());
+    return result.status;
+  }
+  
+private:
+  // the event loop of the completion queue, until it is shut down
+  void AsyncCompleteRpc() {
+    void* tag;
+    bool ok = false;
 
-    for (int i=0; i<m_ServerToSilos.size(); ++i) {
-      thread_list[i] = std::thread(&FedQueryServiceServer::_localSendFilterGridIndex, this, i, circ);
+    while (m_cq.Next(&tag, &ok)) {
+      static_cast<ServerToSilo::AsyncFilterGridCall*>(tag)->Proceed(ok);
     }
-    for (int i=0; i<m_ServerToSilos.size(); ++i) {
-      thread_list[i].join();
-    }   
   }
 
-  void GetFilterGridRecord() {
-    std::vector<std::thread> thread_list(m_ServerToSilos.size());
-
-    for (int i=0; i<m_ServerToSilos.size(); ++i) {
-      thread_list[i] = std::thread(&FedQueryServiceServer::_localGetFilterGridRecord, this, i);
-    }
-    for (int i=0; i<m_ServerToSilos.size(); ++i) {
-      thread_list[i].join();
-    }       
+  void _localRangeQuery(int siloID, const Circle_t& circ) {
+    m_ServerToSilos[siloID]->GetQueryAnswer(circ);
   }
 
-  void m_GetQueryAnswer_byGridIndex(const Circle_t& circ, const int qid=-1) {
+  // the silo streams of one batch of queries in flight
+  struct PendingBatch {
+    std::vector<int> qids;
+    std::vector<Circle_t> circs;
+    std::chrono::steady_clock::time_point startTime;
+    // the verified records of every silo, merged as the chunks arrive
+    std::unique_ptr<BatchResult> result;
+    std::vector<std::future<float>> silo_comms;
+  };
+
+  std::unique_ptr<PendingBatch> StartBatch(const std::vector<Circle_t>& circs, const std::vector<int>& qids,
+                                          const bool forward=false) {
     // step0. initialization
-    log.SetStartTimer();
-    for (int i=0; i<m_ServerToSilos.size(); ++i) {
-      m_ServerToSilos[i]->InitQueryComm();
+    auto batch = std::make_unique<PendingBatch>();
+    batch->qids = qids;
+    batch->circs = circs;
+    batch->startTime = std::chrono::steady_clock::now();
+    batch->result = std::make_unique<BatchResult>(circs.size());
+    batch->result->forward = forward;
+
+    // step1. Perturb the query ranges
+    std::vector<Circle_t> perturb_circs;
+    for (const auto& circ : circs) {
+      std::pair<double,double> perturb_point = DIFFERENTIALPRIVACY::PlanarLaplaceMechanism(circ.x, circ.y, DIFFERENTIALPRIVACY::SPATIAL_DP_EPSILON);
+      Circle_t perturb_circ(circ.qtype, perturb_point.first, perturb_point.second, circ.rad);
+      perturb_circ.rad += ICDE18::GetDistance(Point_t(circ.x, circ.y), Point_t(perturb_circ.x, perturb_circ.y));
+      perturb_circs.emplace_back(perturb_circ);
     }
 
-    // step1. Get Grid Index
-    GetGridIndex();
-
-    // step2. Filter Grid Index
-    std::pair<double,double> perturb_point = DIFFERENTIALPRIVACY::PlanarLaplaceMechanism(circ.x, circ.y, DIFFERENTIALPRIVACY::SPATIAL_DP_EPSILON);
-    Circle_t perturb_circ(circ.qtype, perturb_point.first, perturb_point.second, circ.rad);
-    perturb_circ.rad += ICDE18::GetDistance(Point_t(circ.x, circ.y), Point_t(perturb_circ.x, perturb_circ.y));
+    // step2. Filter the grids and receive their records, one stream per silo for the whole batch
+    //        (the grid index is cached per silo, refreshed on a new epoch),
+    //        every chunk is verified by m_verify_pool as soon as it arrives
+    for (int i=0; i<m_ServerToSilos.size(); ++i) {
+      batch->silo_comms.emplace_back(
+        m_ServerToSilos[i]->AsyncFilterGridRecord(perturb_circs, circs, *batch->result, m_verify_pool.get(), &m_cq));
+    }
 
-    SendFilterGridIndex(perturb_circ);
+    return batch;
+  }
 
-    // step3. Receive records in the filtered grids
-    GetFilterGridRecord();
+  bool FinishBatch(PendingBatch& batch) {
+    const size_t batch_size = batch.circs.size();
+    float batch_comm = 0;
 
-    // step4. Verify the data records
-    m_record_list.clear();
-    size_t m_record_fp = 0;
     for (int i=0; i<m_ServerToSilos.size(); ++i) {
-      std::vector<ICDE18::Record> record_list_tmp;
-      m_ServerToSilos[i]->VerifyGridRecord(circ, record_list_tmp);
-      m_record_fp += m_ServerToSilos[i]->GetRecordFP();
-      m_record_list.insert(m_record_list.end(), record_list_tmp.begin(), record_list_tmp.end());
+      batch_comm += batch.silo_comms[i].get();
     }
-
-    log.SetEndTimer();
-    for (int i=0; i<m_ServerToSilos.size(); ++i) {
-      log.LogAddComm(m_ServerToSilos[i]->GetQueryComm());
+    const float batch_time = QueryLogger::GetElapsedTime(batch.startTime);
+    if (!batch.result->status.ok()) {
+      printf("The batch of queries %d to %d failed: %s\n", batch.qids.front(), batch.qids.back(),
+              batch.result->status.error_message().c_str());
+      fflush(stdout);
+      return false;
     }
-    log.LogOneQuery(CommQueryAnswer(m_record_list));
 
+    for (size_t j=0; j<batch_size; ++j) {
+      // step3. The records of every silo were verified as they arrived
+      const std::vector<Record_t>& record_list = batch.result->record_lists[j];
+      const size_t record_fp = batch.result->record_fps[j];
 
-    /*
-    *   Dump the query result
-    *
-    */
-    printf("%d %zu %zu\n", qid, m_record_list.size(), m_record_fp);
-    std::vector<int> ids_list_tmp;
-    for (auto record : m_record_list) {
-      if (record.has_p()) {
-        ids_list_tmp.emplace_back(record.id());
-      }
-    }
-    sort(ids_list_tmp.begin(), ids_list_tmp.end());
-    for (int i=0; i<ids_list_tmp.size(); ++i) {
-      if (i == 0)
-        printf("%d", ids_list_tmp[i]);
-      else
-        printf(" %d", ids_list_tmp[i]);
+      // the silo streams are shared by the queries of the batch
+      log.LogOneQuery(batch_comm/batch_size + CommQueryAnswer(record_list), batch_time);
+
+      // step4. Dump the query result
+      m_result_writer->Write(batch.qids[j], record_list, record_fp);
     }
-    putchar('\n');
-    fflush(stdout);
+    return true;
   }
 
   void GetQueryAnswer(const Circle_t& circ) {
     log.SetStartTimer();
 
-    std::vector<std::thread> thread_list(m_ServerToSilos.size());
+    std::vector<std::future<void>> futures;
 
     // execute local range query
     for (int i=0; i<m_ServerToSilos.size(); ++i) {
-      thread_list[i] = std::thread(&FedQueryServiceServer::_localRangeQuery, this, i, circ);
+      futures.emplace_back(m_pool->Submit(&FedQueryServiceServer::_localRangeQuery, this, i, circ));
     }
-    for (int i=0; i<m_ServerToSilos.size(); ++i) {
-      thread_list[i].join();
+    for (auto& future : futures) {
+      future.get();
     }
 
     // execute secure aggregation
     m_record_list.clear();
-    std::vector<ICDE18::Record> tmp_list;
+    std::vector<Record_t> tmp_list;
     for (int i=0; i<m_ServerToSilos.size(); ++i) {
       m_ServerToSilos[i]->GetLocalRecord(tmp_list);
       m_record_list.insert(m_record_list.end(), tmp_list.begin(), tmp_list.end());
@@ -673,19 +1424,15 @@ private:
     #ifdef LOCAL_DEBUG
     // printf("There are %d objects in the query range:\n", (int)m_record_list.size());
     // for (auto record : m_record_list) {
-    //   if (record.has_p()) {
-    //     printf("  ID = %d, location = (%.2f,%.2f)\n", 
-    //             record.id(), record.p().x(), record.p().y());
-    //   }
+    //   printf("  ID = %d, location = (%.2f,%.2f)\n", 
+    //           record.ID, record.x, record.y);
     // }
     // fflush(stdout);
 
     printf("%d\n", (int)m_record_list.size());
     std::vector<int> ids_list_tmp;
-    for (auto record : m_record_list) {
-      if (record.has_p()) {
-        ids_list_tmp.emplace_back(record.id());
-      }
+    for (const auto& record : m_record_list) {
+      ids_list_tmp.emplace_back(record.ID);
     }
     for (int i=0; i<ids_list_tmp.size(); ++i) {
       if (i == 0)
@@ -700,13 +1447,59 @@ private:
 
   std::vector<std::shared_ptr<ServerToSilo>> m_ServerToSilos;
   std::vector<std::string> m_IPAddresses;
-  std::vector<ICDE18::Record> m_record_list;
-  std::vector<std::vector<size_t>> m_GridIndexCounts;
+  std::vector<Record_t> m_record_list;
+  std::unique_ptr<ICDE18::ThreadPool> m_pool;
+  std::unique_ptr<ICDE18::ThreadPool> m_verify_pool;
+  std::unique_ptr<ResultWriter> m_result_writer;
+  grpc::CompletionQueue m_cq;
+  std::vector<std::thread> m_cq_threads;
+  size_t m_max_inflight;
+  size_t m_batch_size = 1;
   QueryLogger log;
 };
 
+// the client-facing service of the server, the verified records of a query
+// are forwarded to the client while the silos are still streaming
+class FedQueryCoordinatorImpl final : public FedQueryCoordinator::Service {
+public:
+  FedQueryCoordinatorImpl(FedQueryServiceServer* _fedServer, const size_t chunk_size) :
+    fedServer(_fedServer), records_per_batch(ICDE18::GetRecordsPerBatch(chunk_size)) {}
+
+  Status AnswerFedCircleRangeQuery(ServerContext* context, const CircleQueryRange* request,
+                                   ServerWriter<RecordBatch>* writer) override {
+    const Circle& range = request->range();
+    Circle_t circ(ICDE18::QueryType_t::RANGE_QUERY, range.center().x(), range.center().y(), range.rad());
+
+    // the records are written by this thread, a client that stops reading cancels the query
+    RecordBatch batch;
+    return fedServer->StreamCircleQuery(circ, request->id(), [&](const std::vector<Record_t>& records) {
+      for (size_t i=0; i<records.size(); i+=records_per_batch) {
+        const size_t n = std::min(records_per_batch, records.size() - i);
+        ICDE18::MakeRecordBatch(records.data() + i, n, batch);
+        if (!writer->Write(batch))
+          return false;
+      }
+      return true;
+    }, [context]() {
+      return context->IsCancelled();
+    });
+  }
+
+private:
+  FedQueryServiceServer* fedServer;
+  const size_t records_per_batch;
+};
+
+const std::string SERVER_USAGE =
+  "--query_path=query.txt --ip_path=ip.txt [--chunk_size=65536] [--max_inflight=1] [--cq_threads=1] [--rpc_timeout_ms=0] "
+  "[--batch_size=1] [--verify_threads=0] [--result_path=] [--result_format=text|binary] [--sort_result=1] [--serve_address=]";
+
 int main(int argc, char** argv) {
-  // Expect only arg: --query_path=../../data/query.txt --ip_path=../../data/ip.txt
+  // Expect only arg: --query_path=../../data/query.txt --ip_path=../../data/ip.txt [--chunk_size=65536] [--max_inflight=1] [--cq_threads=1] [--rpc_timeout_ms=0] [--batch_size=1] [--verify_threads=0]
+  //                    [--result_path=] [--result_format=text|binary] [--sort_result=1] [--serve_address=]
+  //
+  // With --serve_address the server answers the queries of its clients with
+  // FedQueryCoordinator instead of the queries of query_path.
   #ifdef LOCAL_DEBUG
   std::cout << argc << std::endl;
   for (int i=0; i<argc; ++i)
@@ -715,6 +1508,16 @@ int main(int argc, char** argv) {
 
   std::string query_file = ICDE18::GetQueryFilePath(argc, argv);
   std::string ip_file = ICDE18::GetSiloIPFilePath(argc, argv);
+  size_t chunk_size = ICDE18::GetSizeArgument(argc, argv, "--chunk_size", ICDE18::DEFAULT_CHUNK_SIZE, SERVER_USAGE);
+  size_t max_inflight = ICDE18::GetSizeArgument(argc, argv, "--max_inflight", 1, SERVER_USAGE);
+  size_t cq_threads = ICDE18::GetSizeArgument(argc, argv, "--cq_threads", 1, SERVER_USAGE);
+  size_t rpc_timeout_ms = ICDE18::GetSizeArgument(argc, argv, "--rpc_timeout_ms", 0, SERVER_USAGE);
+  size_t batch_size = ICDE18::GetSizeArgument(argc, argv, "--batch_size", 1, SERVER_USAGE);
+  size_t verify_threads = ICDE18::GetSizeArgument(argc, argv, "--verify_threads", 0, SERVER_USAGE);
+  std::string result_path = ICDE18::GetArgument(argc, argv, "--result_path", "");
+  std::string result_format = ICDE18::GetArgument(argc, argv, "--result_format", "text");
+  bool sort_result = ICDE18::GetSizeArgument(argc, argv, "--sort_result", 1, SERVER_USAGE) != 0;
+  std::string serve_address = ICDE18::GetArgument(argc, argv, "--serve_address", "");
   
   #ifdef LOCAL_DEBUG
   printf("--query_path=%s --ip_path=%s\n", query_file.c_str(), ip_file.c_str());
@@ -725,15 +1528,40 @@ int main(int argc, char** argv) {
   printf("[Connect] Server\n");
   fflush(stdout);
   #endif
-  FedQueryServiceServer fedServer(ip_file);
+  FedQueryServiceServer fedServer(ip_file, max_inflight, cq_threads, verify_threads);
+  fedServer.SetChunkSize(chunk_size);
+  fedServer.SetRpcTimeout(rpc_timeout_ms);
+  fedServer.SetBatchSize(batch_size);
+
+  if (!serve_address.empty()) {
+    FedQueryCoordinatorImpl coordinator(&fedServer, chunk_size);
+    ServerBuilder builder;
+    builder.AddListeningPort(serve_address, grpc::InsecureServerCredentials());
+    builder.RegisterService(&coordinator);
+    builder.SetMaxSendMessageSize(INT_MAX);
+    std::unique_ptr<Server> server(builder.BuildAndStart());
+    std::cout << "Server listening on " << serve_address << std::endl;
+    server->Wait();
+    return 0;
+  }
+
+  FILE* result_fp = stdout;
+  if (!result_path.empty()) {
+    result_fp = fopen(result_path.c_str(), result_format == "binary" ? "wb" : "w");
+    if (result_fp == NULL) {
+      printf("Failed to open %s\n", result_path.c_str());
+      exit(-1);
+    }
+  }
+  fedServer.SetResultWriter(std::make_unique<ResultWriter>(result_fp, result_format, sort_result));
 
   #ifdef LOCAL_DEBUG
   printf("-------------- Test Circle Range Query --------------\n");
   fflush(stdout);
   #endif
-  fedServer.GetQueryAnswer_byGridIndex(query_file);
+  bool ok = fedServer.GetQueryAnswer_byGridIndex(query_file);
 
 
-  return 0;
+  return ok ? 0 : -1;
 }
 
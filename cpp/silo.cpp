@@ -4,7 +4,9 @@
 #include <iostream>
 #include <iomanip>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
 #include <vector>
 #include <thread>
 #include <signal.h>
@@ -22,6 +24,7 @@
 #include "AES.h"
 #include "differentialprivacy.h"
 #include "grid.hpp"
+#include "points.hpp"
 
 using grpc::Server;
 using grpc::ServerBuilder;
@@ -38,48 +41,71 @@ using ICDE18::Circle;
 using ICDE18::CircleQueryRange;
 using ICDE18::RectangleQueryRange;
 using ICDE18::Record;
+using ICDE18::RecordBatch;
 using ICDE18::EncryptRecord;
+using ICDE18::EncryptRecordChunk;
+using ICDE18::FetchRequest;
 using ICDE18::IntVector;
 using ICDE18::FloatVector;
 using ICDE18::ByteVector;
 using ICDE18::GridIndexCounts;
+using ICDE18::GridFilter;
+using ICDE18::GridFilterBatch;
 using ICDE18::RecordSummary;
 using ICDE18::QueryLogger;
 using ICDE18::FedQueryService;
 using std::chrono::system_clock;
 using INDEX::GridIndex;
 
+// seconds before the filtered grids of an unfetched query session are dropped
+constexpr int SESSION_EXPIRE_SECONDS = 300;
+
 
 class Silo {
 using COUNT_TYPE = int;
 
 public:
-    Silo(const int _siloID=0, const std::string& fileName="", const float _epsilon=1.0) : siloID(_siloID) {
-        SetDataRecord(fileName);
-        SetGridIndex(_epsilon);
+    // grid_k fixes the number of grids per side, otherwise it is chosen from
+    // the data size and points_per_cell, and defaults to the grid_k of a
+    // pre-sorted binary file or GRID_NUM_PER_SIDE.
+    // data_format is "text" (count, then "id x y" per line) or "binary" (PointFileHeader)
+    // max_split > 1 makes the index adaptive: the dense grids are split into
+    // up to max_split by max_split leaves, see GridIndex::split_dense_grids
+    //
+    // If index_snapshot names an existing snapshot, the perturbed index and
+    // its points are loaded from it instead, so a restart publishes the same
+    // counts and spends no new privacy budget. Otherwise the built index is
+    // saved there.
+    Silo(const int _siloID=0, const std::string& fileName="", const float _epsilon=1.0,
+         const size_t grid_k=0, const size_t points_per_cell=0, const std::string& data_format="text",
+         const std::string& index_snapshot="", const size_t max_split=0) : siloID(_siloID) {
+        if (!LoadGridIndex(index_snapshot)) {
+            SetDataRecord(fileName, data_format);
+            SetGridIndex(_epsilon, grid_k, points_per_cell, max_split);
+            if (!index_snapshot.empty()) {
+                m_grid_ptr->save_snapshot(index_snapshot, m_grid_epoch);
+            }
+        }
+
+        printf("Silo %d: DataSize = %zu, PeakRSS = %.2f [MB]\n", siloID, data_ptr->size(), ICDE18::GetPeakRSS() / 1024.0 / 1024.0);
+        fflush(stdout);
     }
     
     void AnswerCircleRangeQuery(const Circle& range, std::vector<Record_t>& ans) {
-        log.SetStartTimer();
+        auto startTime = std::chrono::steady_clock::now();
         ICDE18::Circle_t circ;
 
         circ.rad = range.rad();
         circ.x = range.center().x();
         circ.y = range.center().y();
 
-        ans.clear();
-        for (auto rec : data) {
-            if (IntersectWithRange(rec, circ)) {
-                ans.emplace_back(rec);
-            }
-        }
+        m_grid_ptr->range_query(circ, ans);
 
-        log.SetEndTimer();
-        log.LogOneQuery(CommRangeQuery(range)+CommQueryAnswer(ans));
+        log.LogOneQuery(CommRangeQuery(range)+CommQueryAnswer(ans), QueryLogger::GetElapsedTime(startTime));
     }
 
     void AnswerRectangleRangeQuery(const Rectangle& range, std::vector<Record_t>& ans) {
-        log.SetStartTimer();
+        auto startTime = std::chrono::steady_clock::now();
         ICDE18::Rectangle_t rect;
 
         rect.x = (range.lo().x() + range.hi().x()) * 0.5;
@@ -87,29 +113,18 @@ public:
         rect.dx = std::abs(range.hi().x() - range.lo().x()) * 0.5;
         rect.dy = std::abs(range.hi().y() - range.lo().y()) * 0.5;
 
-        ans.clear();
-        for (auto rec : data) {
-            if (IntersectWithRange(rec, rect)) {
-                ans.emplace_back(rec);
-            }
-        }
+        m_grid_ptr->range_query(rect, ans);
 
-        log.SetEndTimer();
-        log.LogOneQuery(CommRangeQuery(range)+CommQueryAnswer(ans));
+        log.LogOneQuery(CommRangeQuery(range)+CommQueryAnswer(ans), QueryLogger::GetElapsedTime(startTime));
     }
 
     int AnswerCircleRangeCount(const Circle& range, RecordSummary& ans) {
         int ret = 0;
 
-        log.SetStartTimer();
-        for (auto rec : data) {
-            if (IntersectWithRange(rec, range)) {
-                ++ret;
-            }
-        }
+        auto startTime = std::chrono::steady_clock::now();
+        ret = m_grid_ptr->range_count(range);
         ans.set_point_count(ret);
-        log.SetEndTimer();
-        log.LogOneQuery(CommRangeQuery(range)+CommQueryAnswer(ans));
+        log.LogOneQuery(CommRangeQuery(range)+CommQueryAnswer(ans), QueryLogger::GetElapsedTime(startTime));
 
         return ret;
     }
@@ -117,21 +132,16 @@ public:
     int AnswerRectangleRangeCount(const Rectangle& range, RecordSummary& ans) {
         int ret = 0;
 
-        log.SetStartTimer();
-        for (auto rec : data) {
-            if (IntersectWithRange(rec, range)) {
-                ++ret;
-            }
-        }
+        auto startTime = std::chrono::steady_clock::now();
+        ret = m_grid_ptr->range_count(range);
         ans.set_point_count(ret);
-        log.SetEndTimer();
-        log.LogOneQuery(CommRangeQuery(range)+CommQueryAnswer(ans));
+        log.LogOneQuery(CommRangeQuery(range)+CommQueryAnswer(ans), QueryLogger::GetElapsedTime(startTime));
 
         return ret;
     }
 
     int GetDataNum() { 
-        return data.size(); 
+        return data_ptr->size(); 
     }
 
     int GetSiloID() {
@@ -142,10 +152,24 @@ public:
         return siloIP;
     }
 
-    void SetDataRecord(const std::string& fileName) {
-        data.clear();
-        ICDE18::GetInputData(fileName, data);
+    void SetDataRecord(const std::string& fileName, const std::string& data_format="text") {
+        auto startTime = std::chrono::steady_clock::now();
+
+        data_ptr = std::make_shared<ICDE18::PointStore>();
+        if (data_format == "binary") {
+            // the columns are mapped, not read
+            data_ptr->map_file(fileName);
+        } else if (data_format == "text") {
+            std::vector<Record_t> records;
+            ICDE18::GetInputData(fileName, records);
+            // the records are kept as separate x, y and ID arrays
+            data_ptr->assign(records);
+        } else {
+            printf("Unknown data format %s\n", data_format.c_str());
+            exit(-1);
+        }
         printf("-------------- Silo %d Load Data --------------\n", siloID);
+        printf("Load Time: %.0f [ms]\n", QueryLogger::GetElapsedTime(startTime));
         fflush(stdout);
     }
 
@@ -158,7 +182,7 @@ public:
     }
 
     void Print() {
-        printf("SiloID = %d, IPAddress = %s, DataSize = %d\n", siloID, siloIP.c_str(), (int)data.size());
+        printf("SiloID = %d, IPAddress = %s, DataSize = %d\n", siloID, siloIP.c_str(), (int)data_ptr->size());
         printf("The query log is as follows:\n");
         log.Print();
         printf("\n\n");
@@ -185,16 +209,74 @@ public:
         m_grid_ptr->publish_index_counts(_counts);
     }
 
-    void SetFileterGridIDs(const std::vector<size_t>& grid_list) {
-        m_grid_id_list.clear();
-        m_grid_id_list.insert(m_grid_id_list.end(), grid_list.begin(), grid_list.end());
+    void GetIndexSplits(std::vector<size_t>& _splits, std::vector<size_t>& _grid_counts) {
+        m_grid_ptr->publish_index_splits(_splits, _grid_counts);
+    }
+
+    int64_t GetIndexEpoch() {
+        return m_grid_epoch;
+    }
+
+    void SetFileterGridIDs(const int64_t session_id, const std::vector<size_t>& grid_list) {
+        auto now = std::chrono::steady_clock::now();
+        std::lock_guard<std::mutex> lock(m_session_mutex);
+
+        // drop the sessions whose records were never fetched
+        for (auto it=m_sessions.begin(); it!=m_sessions.end(); ) {
+            if (it->second.expire_time < now)
+                it = m_sessions.erase(it);
+            else
+                ++it;
+        }
+
+        QuerySession& session = m_sessions[session_id];
+        session.grid_id_list = grid_list;
+        session.expire_time = now + std::chrono::seconds(SESSION_EXPIRE_SECONDS);
     }
 
-    void GetFilterGridRecord(std::vector<Record_t>& ans) {
+    // the session is consumed, return false if it is unknown or expired
+    bool GetFilterGridRecord(const int64_t session_id, std::vector<Record_t>& ans) {
+        std::vector<size_t> grid_id_list;
+        {
+            std::lock_guard<std::mutex> lock(m_session_mutex);
+            auto it = m_sessions.find(session_id);
+            if (it == m_sessions.end()) {
+                return false;
+            }
+            bool expired = it->second.expire_time < std::chrono::steady_clock::now();
+            grid_id_list.swap(it->second.grid_id_list);
+            m_sessions.erase(it);
+            if (expired) {
+                return false;
+            }
+        }
+
+        GetGridRecord(grid_id_list, ans);
+
+        return true;
+    }
+
+    // the records of the filtered grids, padded or truncated to the perturbed counts
+    void GetGridRecord(const std::vector<size_t>& grid_id_list, std::vector<Record_t>& ans) {
+        std::vector<std::vector<Record_t>> grid_ans;
+        std::default_random_engine rng;
+
+        GetGridRecord(grid_id_list, grid_ans);
         ans.clear();
+        for (const auto& record_list_tmp : grid_ans) {
+            ans.insert(ans.end(), record_list_tmp.begin(), record_list_tmp.end());
+        }
+        std::shuffle(ans.begin(), ans.end(), rng);
+    }
+
+    // same as above, but the records of grid_id_list[i] are kept apart in grid_ans[i]
+    void GetGridRecord(const std::vector<size_t>& grid_id_list, std::vector<std::vector<Record_t>>& grid_ans) {
+        grid_ans.clear();
+        grid_ans.resize(grid_id_list.size());
         std::default_random_engine rng;
 
-        for (size_t gid : m_grid_id_list) {
+        for (size_t i=0; i<grid_id_list.size(); ++i) {
+            const size_t gid = grid_id_list[i];
             COUNT_TYPE perturb_count = m_grid_ptr->get_index_perturb_count(gid);
             COUNT_TYPE true_count = m_grid_ptr->get_index_true_count(gid);
             
@@ -207,7 +289,7 @@ public:
                 perturb_count = -perturb_count; // equivalent to overflow array
             }
             
-            std::vector<Record_t> record_list_tmp;
+            std::vector<Record_t>& record_list_tmp = grid_ans[i];
             m_grid_ptr->get_index_record(gid, record_list_tmp);
             
             #ifdef LOCAL_DEBUG
@@ -217,49 +299,94 @@ public:
             #endif
             
             if (perturb_count < true_count) {// randomly remove some record
-                std::shuffle(record_list_tmp.begin(), record_list_tmp.end(), rng);
                 /**
                 ** The following line is based on the original paper, 
-                ** remove some record when meeting negative noise in the grid cunt
+                ** remove some record when meeting negative noise in the grid cunt.
+                ** The removed records were drawn by perturb_index_counts and are
+                ** at the end of the grid.
                 **/
                 record_list_tmp.resize(perturb_count);
+                std::shuffle(record_list_tmp.begin(), record_list_tmp.end(), rng);
             } else if (perturb_count > true_count) {
                 ICDE18::Record_t dummy_record_tmp(-1, -1e10, -1e10);
                 for (size_t i=true_count; i<perturb_count; ++i) {
                     record_list_tmp.emplace_back(dummy_record_tmp);
                 }
+                std::shuffle(record_list_tmp.begin(), record_list_tmp.end(), rng);
             }
-            ans.insert(ans.end(), record_list_tmp.begin(), record_list_tmp.end());
 
             #ifdef LOCAL_DEBUG
             assert(perturb_count == record_list_tmp.size());
-            printf(", record_list_local.size() = %zu", record_list_tmp.size());
-            printf(", ans.size() = %zu\n", ans.size());
+            printf(", record_list_local.size() = %zu\n", record_list_tmp.size());
             fflush(stdout);
             #endif
         }
-        std::shuffle(ans.begin(), ans.end(), rng);
     }
 
 private:
-    void SetGridIndex(float epsilon) {
-        std::shared_ptr<std::vector<ICDE18::Record_t>> data_ptr = std::make_shared<std::vector<ICDE18::Record_t>>(this->data);
-        m_grid_ptr = std::make_unique<GridIndex<GRID_NUM_PER_SIDE>>(data_ptr);
-        m_grid_ptr->perturb_index_counts(epsilon);
+    // filtered grid ids of one in-flight query
+    struct QuerySession {
+        std::vector<size_t> grid_id_list;
+        std::chrono::steady_clock::time_point expire_time;
+    };
+
+    bool LoadGridIndex(const std::string& index_snapshot) {
+        if (index_snapshot.empty())
+            return false;
+
+        auto startTime = std::chrono::steady_clock::now();
+        m_grid_ptr = GridIndex<>::load_snapshot(index_snapshot, m_grid_epoch);
+        if (!m_grid_ptr)
+            return false;
+        data_ptr = m_grid_ptr->get_points();
+
+        printf("-------------- Silo %d Load Index Snapshot --------------\n", siloID);
+        printf("Load Time: %.0f [ms]\n", QueryLogger::GetElapsedTime(startTime));
+        fflush(stdout);
+        return true;
+    }
+
+    void SetGridIndex(float epsilon, size_t grid_k, size_t points_per_cell, size_t max_split) {
+        if (grid_k == 0 && points_per_cell == 0 && data_ptr->grid_k() != 0) {
+            // the points of the file are already in grid order, the sort is a single pass
+            grid_k = data_ptr->grid_k();
+        } else if (grid_k == 0) {
+            grid_k = INDEX::ChooseGridK(data_ptr->size(), points_per_cell);
+        }
+        // the grid reorders the shared records in place, no copy is made
+        m_grid_ptr = std::make_unique<GridIndex<>>(data_ptr, grid_k);
+        if (max_split > 1) {
+            // a leaf of a split grid holds about points_per_cell points, or
+            // the average of a grid if neither was given
+            m_grid_ptr->perturb_adaptive_index_counts(epsilon, max_split, points_per_cell);
+        } else {
+            m_grid_ptr->perturb_index_counts(epsilon);
+        }
+
+        // the published counts are only valid under this epoch
+        m_grid_epoch = std::chrono::duration_cast<std::chrono::milliseconds>(
+            system_clock::now().time_since_epoch()).count();
     }
 
     int siloID;
     QueryLogger log;
-    std::vector<Record_t> data;
-    std::vector<size_t> m_grid_id_list;
+    // the records of this silo ordered by grid id, shared with m_grid_ptr
+    std::shared_ptr<ICDE18::PointStore> data_ptr;
+    std::unordered_map<int64_t, QuerySession> m_sessions;
+    std::mutex m_session_mutex;
     std::string siloIP;
-    std::unique_ptr<GridIndex<GRID_NUM_PER_SIDE>> m_grid_ptr;
+    std::unique_ptr<GridIndex<>> m_grid_ptr;
+    int64_t m_grid_epoch = 0;
 };
 
 class FedQueryServiceImpl final : public FedQueryService::Service {
 public:
-    explicit FedQueryServiceImpl(const int siloID, const std::string& fileName) {
-        m_silo = std::make_unique<Silo>(siloID, fileName, DIFFERENTIALPRIVACY::SPATIAL_DP_EPSILON);  
+    explicit FedQueryServiceImpl(const int siloID, const std::string& fileName,
+                                 const size_t grid_k=0, const size_t points_per_cell=0,
+                                 const std::string& data_format="text", const std::string& index_snapshot="",
+                                 const size_t max_split=0) {
+        m_silo = std::make_unique<Silo>(siloID, fileName, DIFFERENTIALPRIVACY::SPATIAL_DP_EPSILON, grid_k, points_per_cell,
+                                        data_format, index_snapshot, max_split);  
         
         const size_t n_keys = 256 / 8;
         m_EncryptKeys.resize(n_keys);
@@ -267,25 +394,19 @@ public:
         for (size_t i=0; i<n_keys; ++i) {
             m_EncryptKeys[i] = rand() % (1 + UCHAR_MAX);
         }
+        m_aes.SetKey(m_EncryptKeys);
     }
 
     Status AnswerRectangleRangeQuery(ServerContext* context,
                         const ICDE18::Rectangle* rectangle,
-                        ServerWriter<Record>* writer) override {
-        log.SetStartTimer();
-        Record record;
-        m_RecordVector.clear();
+                        ServerWriter<RecordBatch>* writer) override {
+        auto startTime = std::chrono::steady_clock::now();
 
         std::vector<Record_t> ans;
         m_silo->AnswerRectangleRangeQuery(*rectangle, ans);
-        for (auto record_ : ans) {
-           record = MakeRecord(record_);
-           m_RecordVector.emplace_back(record_);
-           writer->Write(record);
-        }
+        float grpc_comm = WriteRecordBatches(ans, ICDE18::DEFAULT_CHUNK_SIZE, writer);
 
-        log.SetEndTimer();
-        log.LogOneQuery(record.ByteSizeLong() * ans.size());
+        log.LogOneQuery(grpc_comm, QueryLogger::GetElapsedTime(startTime));
 
         return Status::OK;
     }
@@ -322,12 +443,22 @@ public:
         m_silo->GetIndexCounts(_counts);
         IntVector counts;
         ICDE18::CopyFromVector<size_t>(counts, _counts);
+
+        // empty unless the index is adaptive
+        std::vector<size_t> _splits, _level_counts;
+        m_silo->GetIndexSplits(_splits, _level_counts);
+        IntVector splits, level_counts;
+        ICDE18::CopyFromVector<size_t>(splits, _splits);
+        ICDE18::CopyFromVector<size_t>(level_counts, _level_counts);
         
         grid_counts->set_k(m_silo->GetK());
         grid_counts->mutable_mins()->CopyFrom(mins);
         grid_counts->mutable_maxs()->CopyFrom(maxs);
         grid_counts->mutable_widths()->CopyFrom(widths);
         grid_counts->mutable_counts()->CopyFrom(counts);
+        grid_counts->mutable_splits()->CopyFrom(splits);
+        grid_counts->mutable_grid_counts()->CopyFrom(level_counts);
+        grid_counts->set_epoch(m_silo->GetIndexEpoch());
 
         log.LogAddComm(grid_counts->ByteSizeLong());
 
@@ -343,14 +474,14 @@ public:
         return Status::OK;
     }
 
-    Status SendFilterGridIndex(ServerContext* context, const IntVector* request, 
+    Status SendFilterGridIndex(ServerContext* context, const GridFilter* request, 
         Empty* response) override {
-        std::vector<size_t> grid_ids_list;
-
-        for (size_t i=0, sz=request->size(); i<sz; ++i) {
-            grid_ids_list.emplace_back(request->values(i));
+        // the server filtered with an outdated grid index
+        if (request->epoch() != m_silo->GetIndexEpoch()) {
+            return Status(grpc::StatusCode::FAILED_PRECONDITION, "stale grid index epoch");
         }
-        m_silo->SetFileterGridIDs(grid_ids_list);
+
+        m_silo->SetFileterGridIDs(request->session_id(), GetGridIDs(*request));
         
         log.LogAddComm(request->ByteSizeLong());
 
@@ -358,10 +489,9 @@ public:
     }
 
     Status GetFilterGridRecord(ServerContext* context,
-                        const Empty* circle,
-                        ServerWriter<Record>* writer) override {
-        Record record;
-        m_RecordVector.clear();
+                        const FetchRequest* request,
+                        ServerWriter<RecordBatch>* writer) override {
+        auto startTime = std::chrono::steady_clock::now();
 
         #ifdef LOCAL_DEBUG
         printf("Silo %d: GetFilterGridRecord START\n", m_silo->GetSiloID());
@@ -370,18 +500,16 @@ public:
         #endif
 
         std::vector<Record_t> ans;
-        m_silo->GetFilterGridRecord(ans);
+        if (!m_silo->GetFilterGridRecord(request->session_id(), ans)) {
+            return Status(grpc::StatusCode::NOT_FOUND, "unknown or expired query session");
+        }
 
         #ifdef LOCAL_DEBUG
         printf("Silo %d: GetFilterGridRecord DONE\n", m_silo->GetSiloID());
         fflush(stdout);
         #endif
-        for (auto record_ : ans) {
-           m_RecordVector.emplace_back(record_);
-           record = MakeRecord(record_);
-           writer->Write(record);
-        }
-        log.LogOneQuery(record.ByteSizeLong() * ans.size());
+        float grpc_comm = WriteRecordBatches(ans, request->chunk_size(), writer);
+        log.LogOneQuery(grpc_comm, QueryLogger::GetElapsedTime(startTime));
 
         #ifdef LOCAL_DEBUG
         printf("There are %zu objects in the query range:\n", ans.size());
@@ -398,22 +526,128 @@ public:
     Status GetFilterGridEncryptRecord(ServerContext* context,
                         const Empty* empty_request,
                         ServerWriter<EncryptRecord>* writer) override {
+        auto startTime = std::chrono::steady_clock::now();
         EncryptRecord record;
         int record_id = 0;
-        m_RecordVector.clear();
         float grpc_comm = 0.0;
 
+        // the request carries no session, use the default one
         std::vector<Record_t> ans;
-        m_silo->GetFilterGridRecord(ans);
+        if (!m_silo->GetFilterGridRecord(0, ans)) {
+            return Status(grpc::StatusCode::NOT_FOUND, "unknown or expired query session");
+        }
 
         for (auto record_ : ans) {
-           m_RecordVector.emplace_back(record_);
-           record = MakeEncryptRecord(record_id, record_);
+           MakeEncryptRecord(record_id, record_, record);
            writer->Write(record);
            record_id++;
            grpc_comm += record.ByteSizeLong();
         }
-        log.LogOneQuery(grpc_comm);
+        log.LogOneQuery(grpc_comm, QueryLogger::GetElapsedTime(startTime));
+
+        return Status::OK;
+    }
+
+    Status GetFilterGridEncryptChunk(ServerContext* context,
+                        const FetchRequest* request,
+                        ServerWriter<EncryptRecordChunk>* writer) override {
+        auto startTime = std::chrono::steady_clock::now();
+
+        std::vector<Record_t> ans;
+        if (!m_silo->GetFilterGridRecord(request->session_id(), ans)) {
+            return Status(grpc::StatusCode::NOT_FOUND, "unknown or expired query session");
+        }
+
+        float grpc_comm = WriteEncryptChunks(ans, request->chunk_size(), writer);
+        log.LogOneQuery(grpc_comm, QueryLogger::GetElapsedTime(startTime));
+
+        return Status::OK;
+    }
+
+    Status FilterGridEncryptChunk(ServerContext* context,
+                        const GridFilter* request,
+                        ServerWriter<EncryptRecordChunk>* writer) override {
+        auto startTime = std::chrono::steady_clock::now();
+
+        // the server filtered with an outdated grid index
+        if (request->epoch() != m_silo->GetIndexEpoch()) {
+            return Status(grpc::StatusCode::FAILED_PRECONDITION, "stale grid index epoch");
+        }
+
+        std::vector<Record_t> ans;
+        m_silo->GetGridRecord(GetGridIDs(*request), ans);
+
+        float grpc_comm = request->ByteSizeLong();
+        grpc_comm += WriteEncryptChunks(ans, request->chunk_size(), writer);
+        log.LogOneQuery(grpc_comm, QueryLogger::GetElapsedTime(startTime));
+
+        return Status::OK;
+    }
+
+    Status FilterGridRecord(ServerContext* context,
+                        const GridFilter* request,
+                        ServerWriter<RecordBatch>* writer) override {
+        auto startTime = std::chrono::steady_clock::now();
+
+        // the server filtered with an outdated grid index
+        if (request->epoch() != m_silo->GetIndexEpoch()) {
+            return Status(grpc::StatusCode::FAILED_PRECONDITION, "stale grid index epoch");
+        }
+
+        std::vector<Record_t> ans;
+        m_silo->GetGridRecord(GetGridIDs(*request), ans);
+
+        float grpc_comm = request->ByteSizeLong();
+        grpc_comm += WriteRecordBatches(ans, request->chunk_size(), writer);
+        log.LogOneQuery(grpc_comm, QueryLogger::GetElapsedTime(startTime));
+
+        return Status::OK;
+    }
+
+    Status FilterGridEncryptChunkBatch(ServerContext* context,
+                        const GridFilterBatch* request,
+                        ServerWriter<EncryptRecordChunk>* writer) override {
+        auto startTime = std::chrono::steady_clock::now();
+
+        // the server filtered with an outdated grid index
+        if (request->epoch() != m_silo->GetIndexEpoch()) {
+            return Status(grpc::StatusCode::FAILED_PRECONDITION, "stale grid index epoch");
+        }
+
+        // each grid shared by the queries of the batch is streamed once
+        std::vector<size_t> grid_id_list = GetGridIDs(*request);
+        std::vector<std::vector<Record_t>> grid_ans;
+        m_silo->GetGridRecord(grid_id_list, grid_ans);
+
+        float grpc_comm = request->ByteSizeLong();
+        for (size_t i=0; i<grid_id_list.size(); ++i) {
+            grpc_comm += WriteEncryptChunks(grid_ans[i], request->chunk_size(), writer, grid_id_list[i]);
+        }
+        log.LogOneQuery(grpc_comm, QueryLogger::GetElapsedTime(startTime));
+
+        return Status::OK;
+    }
+
+    Status FilterGridRecordBatch(ServerContext* context,
+                        const GridFilterBatch* request,
+                        ServerWriter<RecordBatch>* writer) override {
+        auto startTime = std::chrono::steady_clock::now();
+
+        // the server filtered with an outdated grid index
+        if (request->epoch() != m_silo->GetIndexEpoch()) {
+            return Status(grpc::StatusCode::FAILED_PRECONDITION, "stale grid index epoch");
+        }
+
+        // each grid shared by the queries of the batch is streamed once
+        std::vector<size_t> grid_id_list = GetGridIDs(*request);
+        std::vector<std::vector<Record_t>> grid_ans;
+        m_silo->GetGridRecord(grid_id_list, grid_ans);
+
+        float grpc_comm = request->ByteSizeLong();
+        for (size_t i=0; i<grid_id_list.size(); ++i) {
+            grpc_comm += WriteRecordBatches(grid_ans[i], request->chunk_size(), writer, grid_id_list[i]);
+        }
+        log.LogOneQuery(grpc_comm, QueryLogger::GetElapsedTime(startTime));
 
         return Status::OK;
     }
@@ -443,10 +677,8 @@ public:
 
     Status AnswerCircleRangeQuery(ServerContext* context,
                         const ICDE18::Circle* circle,
-                        ServerWriter<Record>* writer) override {
-        log.SetStartTimer();
-        Record record;
-        m_RecordVector.clear();
+                        ServerWriter<RecordBatch>* writer) override {
+        auto startTime = std::chrono::steady_clock::now();
 
         #ifdef LOCAL_DEBUG
         printf("Silo %d: CircleRangeQuery, center=(%.2f,%.2f), rad=%.2f\n", 
@@ -457,14 +689,9 @@ public:
 
         std::vector<Record_t> ans;
         m_silo->AnswerCircleRangeQuery(*circle, ans);
-        for (auto record_ : ans) {
-           record = MakeRecord(record_);
-           m_RecordVector.emplace_back(record_);
-           writer->Write(record);
-        }
+        float grpc_comm = WriteRecordBatches(ans, ICDE18::DEFAULT_CHUNK_SIZE, writer);
 
-        log.SetEndTimer();
-        log.LogOneQuery(record.ByteSizeLong() * ans.size());
+        log.LogOneQuery(grpc_comm, QueryLogger::GetElapsedTime(startTime));
 
         return Status::OK;
     }
@@ -474,44 +701,100 @@ public:
     }
 
 private:
-    Record MakeRecord(const Record_t& r) {
-        Record ret;
-        Point p;
-
-        ret.set_id(r.ID);
-        p.set_x(r.x);
-        p.set_y(r.y);
-        ret.mutable_p()->CopyFrom(p);
-        
-        return ret;
+    // stream the records in columnar batches of at most chunk_size bytes
+    float WriteRecordBatches(const std::vector<Record_t>& ans, const size_t chunk_size, 
+                        ServerWriter<RecordBatch>* writer, const int grid_id=0) {
+        RecordBatch batch;
+        float grpc_comm = 0.0;
+        const size_t records_per_batch = ICDE18::GetRecordsPerBatch(chunk_size);
+
+        for (size_t start=0; start<ans.size(); start+=records_per_batch) {
+            const size_t n_records = std::min(records_per_batch, ans.size()-start);
+            ICDE18::MakeRecordBatch(ans.data()+start, n_records, batch);
+            batch.set_grid_id(grid_id);
+            writer->Write(batch);
+            grpc_comm += batch.ByteSizeLong();
+        }
+
+        return grpc_comm;
     }
 
-    EncryptRecord MakeEncryptRecord(const int _id, const Record_t& r) {
-        AES aes(AESKeyLength::AES_256);
+    // pack the records of one chunk into a contiguous plaintext buffer,
+    // and encrypt it in a single call
+    float WriteEncryptChunks(const std::vector<Record_t>& ans, const size_t chunk_size, 
+                        ServerWriter<EncryptRecordChunk>* writer, const int grid_id=0) {
+        EncryptRecordChunk chunk;
+        int chunk_id = 0;
+        float grpc_comm = 0.0;
+        const size_t records_per_chunk = ICDE18::GetRecordsPerChunk(chunk_size);
+        std::vector<unsigned char> plain_data(std::min(records_per_chunk, ans.size()) * ICDE18::RECORD_BLOCK_SIZE);
 
-        std::vector<unsigned char> plain_data = SerializeRecord(r);
-        std::vector<unsigned char> encrypt_data = aes.EncryptECB(plain_data, m_EncryptKeys);
-        std::string data_str(encrypt_data.begin(), encrypt_data.end());
+        for (size_t start=0; start<ans.size(); start+=records_per_chunk) {
+            const size_t n_records = std::min(records_per_chunk, ans.size()-start);
+            const size_t n_bytes = n_records * ICDE18::RECORD_BLOCK_SIZE;
+
+            for (size_t i=0; i<n_records; ++i) {
+                ICDE18::SerializeRecord(ans[start+i], plain_data.data() + i*ICDE18::RECORD_BLOCK_SIZE);
+            }
+
+            std::string* encrypt_data = chunk.mutable_data();
+            encrypt_data->resize(n_bytes);
+            m_aes.EncryptBlocks(plain_data.data(), n_bytes, reinterpret_cast<unsigned char*>(&(*encrypt_data)[0]));
+            chunk.set_id(chunk_id++);
+            chunk.set_size(n_records);
+            chunk.set_grid_id(grid_id);
+
+            writer->Write(chunk);
+            grpc_comm += chunk.ByteSizeLong();
+        }
+
+        return grpc_comm;
+    }
+
+    std::vector<size_t> GetGridIDs(const GridFilter& request) {
+        const IntVector& grid_ids = request.grid_ids();
+        std::vector<size_t> grid_ids_list(grid_ids.values().begin(), grid_ids.values().end());
+        return grid_ids_list;
+    }
+
+    // the union of the filtered grids of all queries in the batch
+    std::vector<size_t> GetGridIDs(const GridFilterBatch& request) {
+        std::vector<size_t> grid_ids_list;
+        for (const IntVector& grid_ids : request.grid_ids()) {
+            grid_ids_list.insert(grid_ids_list.end(), grid_ids.values().begin(), grid_ids.values().end());
+        }
+        std::sort(grid_ids_list.begin(), grid_ids_list.end());
+        grid_ids_list.erase(std::unique(grid_ids_list.begin(), grid_ids_list.end()), grid_ids_list.end());
+        return grid_ids_list;
+    }
+
+    // fill ret in place, so the message buffer is reused across records
+    void MakeEncryptRecord(const int _id, const Record_t& r, EncryptRecord& ret) {
+        unsigned char plain_data[ICDE18::RECORD_BLOCK_SIZE];
+        unsigned char encrypt_data[ICDE18::RECORD_BLOCK_SIZE];
+
+        ICDE18::SerializeRecord(r, plain_data);
+        m_aes.EncryptBlocks(plain_data, ICDE18::RECORD_BLOCK_SIZE, encrypt_data);
        
-        EncryptRecord ret;
         ret.set_id(_id);
-        ret.set_data(data_str);
-        
-        return ret;
+        ret.set_data(encrypt_data, ICDE18::RECORD_BLOCK_SIZE);
     }
     
-    std::vector<Record_t> m_RecordVector;
     std::vector<unsigned char> m_EncryptKeys;
+    AES m_aes{AESKeyLength::AES_256};
     std::unique_ptr<Silo> m_silo;
     QueryLogger log;
 };
 
 std::unique_ptr<FedQueryServiceImpl> siloService_ptr;
 
-void RunSilo(const int siloID, const std::string& IPAddress, const std::string& data_file) {
+void RunSilo(const int siloID, const std::string& IPAddress, const std::string& data_file,
+             const size_t grid_k, const size_t points_per_cell, const std::string& data_format,
+             const std::string& index_snapshot, const size_t max_split) {
     std::string server_address(IPAddress);
 
-    siloService_ptr = std::make_unique<FedQueryServiceImpl>(siloID, data_file);
+    siloService_ptr = std::make_unique<FedQueryServiceImpl>(siloID, data_file, grid_k, points_per_cell, data_format, index_snapshot,
+                                                            max_split);
     // FedQueryServiceImpl siloService(siloID, data_file);
 
     ServerBuilder builder;
@@ -540,15 +823,24 @@ void ResetSignalHandler() {
     signal(SIGKILL, SignalHandler);
 }
 
+const std::string SILO_USAGE =
+    "--ip=0.0.0.0:50051 --data_path=data_01.txt --silo_id=1 [--grid_k=10] [--points_per_cell=0] [--data_format=text|binary] "
+    "[--index_snapshot=silo1.index] [--max_split=0]";
+
 int main(int argc, char** argv) {
     ResetSignalHandler();
 
-    // Expect two args: --ip=0.0.0.0:50051 --data_path=../../data/data_01.txt --silo_id=1
+    // Expect two args: --ip=0.0.0.0:50051 --data_path=../../data/data_01.txt --silo_id=1 [--grid_k=10] [--points_per_cell=0] [--data_format=text|binary] [--index_snapshot=silo1.index] [--max_split=0]
     std::string IPAddress = ICDE18::GetIPAddress(argc, argv);
     std::string data_file = ICDE18::GetDataFilePath(argc, argv);
     int siloID = ICDE18::GetSiloID(argc, argv);
+    size_t grid_k = ICDE18::GetSizeArgument(argc, argv, "--grid_k", 0, SILO_USAGE);
+    size_t points_per_cell = ICDE18::GetSizeArgument(argc, argv, "--points_per_cell", 0, SILO_USAGE);
+    std::string data_format = ICDE18::GetArgument(argc, argv, "--data_format", "text");
+    std::string index_snapshot = ICDE18::GetArgument(argc, argv, "--index_snapshot", "");
+    size_t max_split = ICDE18::GetSizeArgument(argc, argv, "--max_split", 0, SILO_USAGE);
 
-    RunSilo(siloID, IPAddress, data_file);
+    RunSilo(siloID, IPAddress, data_file, grid_k, points_per_cell, data_format, index_snapshot, max_split);
 
     return 0;
 }
@@ -60,8 +60,8 @@ int main(int argc, char** argv) {
         }
     }
 
-    std::shared_ptr<std::vector<ICDE18::Record_t>> ptr = std::make_shared<std::vector<ICDE18::Record_t>>(alldata);
-    INDEX::GridIndex<5> grid(ptr);
+    std::shared_ptr<ICDE18::PointStore> ptr = std::make_shared<ICDE18::PointStore>(alldata);
+    INDEX::GridIndex<> grid(ptr, 5);
     vector<ICDE18::Record_t> tmp = grid.range_query(circ);
     for (auto rec : tmp) {
         res.emplace_back(rec.ID);
@@ -0,0 +1,106 @@
+#ifndef GRPC_COMMON_CPP_THREAD_POOL_H_
+#define GRPC_COMMON_CPP_THREAD_POOL_H_
+
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace ICDE18 {
+
+// fixed pool of long-lived workers
+//
+// Tasks are run in FIFO order, and their results are returned as futures.
+// The workers are created once, so submitting a task costs a queue push
+// rather than a thread creation.
+//
+// With max_queued > 0 the queue is bounded: Submit blocks while max_queued
+// tasks are waiting, so a fast producer is held back to the pace of the
+// workers instead of buffering without limit.
+class ThreadPool {
+public:
+    explicit ThreadPool(size_t n_threads, size_t _max_queued=0) : max_queued(_max_queued) {
+        if (n_threads == 0) {
+            n_threads = 1;
+        }
+        workers.reserve(n_threads);
+        for (size_t i=0; i<n_threads; ++i) {
+            workers.emplace_back(&ThreadPool::WorkerLoop, this);
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // the queued tasks are finished before the workers exit
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            stopped = true;
+        }
+        queueCond.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    template<typename F, typename... Args>
+    auto Submit(F&& f, Args&&... args) -> std::future<typename std::invoke_result<F, Args...>::type> {
+        using R = typename std::invoke_result<F, Args...>::type;
+
+        auto task = std::make_shared<std::packaged_task<R()>>(
+            std::bind(std::forward<F>(f), std::forward<Args>(args)...));
+        std::future<R> ret = task->get_future();
+        {
+            std::unique_lock<std::mutex> lock(queueMutex);
+            if (max_queued > 0) {
+                spaceCond.wait(lock, [this]() { return tasks.size() < max_queued; });
+            }
+            tasks.emplace([task]() { (*task)(); });
+        }
+        queueCond.notify_one();
+
+        return ret;
+    }
+
+    size_t Size() const {
+        return workers.size();
+    }
+
+private:
+    void WorkerLoop() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(queueMutex);
+                queueCond.wait(lock, [this]() { return stopped || !tasks.empty(); });
+                if (stopped && tasks.empty()) {
+                    return;
+                }
+                task = std::move(tasks.front());
+                tasks.pop();
+            }
+            if (max_queued > 0) {
+                spaceCond.notify_one();
+            }
+            task();
+        }
+    }
+
+    std::vector<std::thread> workers;
+    std::queue<std::function<void()>> tasks;
+    std::mutex queueMutex;
+    std::condition_variable queueCond;
+    std::condition_variable spaceCond;
+    const size_t max_queued;
+    bool stopped = false;
+};
+
+}
+
+#endif // GRPC_COMMON_CPP_THREAD_POOL_H_
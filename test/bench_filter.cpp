@@ -0,0 +1,148 @@
+// Checks every point-in-range filter backend against the array-of-structs
+// predicate used by the server and silos, and reports the throughput of each
+// one in points/sec.
+//
+// Usage: ./bench_filter [number_of_points]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "filter.h"
+
+using namespace std;
+
+const FilterBackend backends[] = {FilterBackend::SCALAR, FilterBackend::AVX2, FilterBackend::AVX512};
+
+// the same layout and expressions as Record_t and IntersectWithRange in global.h
+struct Record {
+    int ID;
+    float x, y;
+};
+
+size_t AosFilterCircle(const vector<Record>& records, float cx, float cy, float rad, uint32_t* idx) {
+    size_t ret = 0;
+    for (size_t i=0; i<records.size(); ++i) {
+        float deltax = records[i].x - cx;
+        float deltay = records[i].y - cy;
+        if (deltax*deltax + deltay*deltay <= rad*rad)
+            idx[ret++] = i;
+    }
+    return ret;
+}
+
+size_t AosFilterRectangle(const vector<Record>& records, float x, float y, float dx, float dy, uint32_t* idx) {
+    float lo_x = x - dx, hi_x = x + dx;
+    float lo_y = y - dy, hi_y = y + dy;
+    size_t ret = 0;
+    for (size_t i=0; i<records.size(); ++i) {
+        float ax = records[i].x, ay = records[i].y;
+        if ((lo_x<=ax && ax<=hi_x) && (lo_y<=ay && ay<=hi_y))
+            idx[ret++] = i;
+    }
+    return ret;
+}
+
+struct Query {
+    float x, y, rad;
+};
+
+// points on and near the range boundary are included to catch rounding differences
+bool CheckAgainstAos(FilterBackend backend, const vector<Record>& records,
+                     const vector<float>& xs, const vector<float>& ys, const vector<Query>& queries) {
+    vector<uint32_t> expected(records.size()), idx(records.size());
+    bool ok = true;
+
+    for (const auto& q : queries) {
+        for (size_t n : {records.size(), records.size() - 7, size_t(13)}) {
+            vector<Record> prefix(records.begin(), records.begin() + n);
+            size_t m = AosFilterCircle(prefix, q.x, q.y, q.rad, expected.data());
+            size_t k = FILTER::FilterCircle(backend, xs.data(), ys.data(), n, q.x, q.y, q.rad, idx.data());
+            ok = ok && m==k && equal(expected.begin(), expected.begin()+m, idx.begin());
+
+            m = AosFilterRectangle(prefix, q.x, q.y, q.rad, q.rad*0.5f, expected.data());
+            k = FILTER::FilterRectangle(backend, xs.data(), ys.data(), n, q.x, q.y, q.rad, q.rad*0.5f, idx.data());
+            ok = ok && m==k && equal(expected.begin(), expected.begin()+m, idx.begin());
+        }
+    }
+
+    return ok;
+}
+
+template<typename F>
+double PointsPerSecond(size_t n, const vector<Query>& queries, F&& filter) {
+    size_t hits = 0;
+    auto start = chrono::steady_clock::now();
+    for (const auto& q : queries) {
+        hits += filter(q);
+    }
+    auto end = chrono::steady_clock::now();
+    double seconds = chrono::duration<double>(end - start).count();
+    // keep the result alive
+    if (hits == size_t(-1))
+        printf("%zu\n", hits);
+    return double(n) * queries.size() / seconds;
+}
+
+int main(int argc, char** argv) {
+    const size_t n = (argc > 1) ? strtoul(argv[1], NULL, 10) : (1 << 20);
+    mt19937 gen(2024);
+    uniform_real_distribution<float> coord(0.0f, 1e4f);
+    uniform_real_distribution<float> radius(10.0f, 2e3f);
+    bool all_ok = true;
+
+    vector<Record> records(n);
+    vector<float> xs(n), ys(n);
+    for (size_t i=0; i<n; ++i) {
+        records[i] = {int(i), coord(gen), coord(gen)};
+        xs[i] = records[i].x;
+        ys[i] = records[i].y;
+    }
+
+    vector<Query> queries(32);
+    for (auto& q : queries) {
+        q = {coord(gen), coord(gen), radius(gen)};
+    }
+    // a query centered on a data point with the radius reaching another one
+    queries[0] = {records[0].x, records[0].y, 0.0f};
+    queries[1] = {records[1].x, records[1].y, records[2].x - records[1].x};
+
+    printf("-------------- Filter Backend Check --------------\n");
+    for (auto backend : backends) {
+        if (!FILTER::IsSupported(backend)) {
+            printf("%-10s not supported on this cpu\n", FILTER::BackendName(backend));
+            continue;
+        }
+        bool ok = CheckAgainstAos(backend, records, xs, ys, queries);
+        printf("%-10s %s\n", FILTER::BackendName(backend), ok ? "OK" : "MISMATCH");
+        all_ok = all_ok && ok;
+    }
+
+    printf("-------------- Filter Backend Benchmark (%zu points, %zu queries) --------------\n", n, queries.size());
+    vector<uint32_t> idx(n);
+    double circ = PointsPerSecond(n, queries, [&](const Query& q) {
+        return AosFilterCircle(records, q.x, q.y, q.rad, idx.data());
+    });
+    double rect = PointsPerSecond(n, queries, [&](const Query& q) {
+        return AosFilterRectangle(records, q.x, q.y, q.rad, q.rad, idx.data());
+    });
+    printf("%-10s circle = %.3e [points/s], rectangle = %.3e [points/s]\n", "aos", circ, rect);
+    for (auto backend : backends) {
+        if (!FILTER::IsSupported(backend))
+            continue;
+        circ = PointsPerSecond(n, queries, [&](const Query& q) {
+            return FILTER::FilterCircle(backend, xs.data(), ys.data(), n, q.x, q.y, q.rad, idx.data());
+        });
+        rect = PointsPerSecond(n, queries, [&](const Query& q) {
+            return FILTER::FilterRectangle(backend, xs.data(), ys.data(), n, q.x, q.y, q.rad, q.rad, idx.data());
+        });
+        printf("%-10s circle = %.3e [points/s], rectangle = %.3e [points/s]\n",
+                FILTER::BackendName(backend), circ, rect);
+    }
+    fflush(stdout);
+
+    return all_ok ? 0 : 1;
+}
@@ -0,0 +1,79 @@
+// Compares the load time of the silo data files between the line-by-line
+// iostream parser and the parallel loader of global.cpp, for an increasing
+// number of threads, and checks that both return the same records.
+//
+// Usage: ./bench_load data_file [data_file ...]
+//
+// data_file is in the silo input format, e.g. ../data/data_1.txt.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "global.h"
+
+using namespace std;
+using ICDE18::Record_t;
+
+// the loader before the parallel one
+void GetInputDataStream(const string& fileName, vector<Record_t>& records) {
+    ifstream fin(fileName);
+    int n = 0;
+    fin >> n;
+    records.resize(n);
+    for (int i=0; i<n; ++i) {
+        fin >> records[i].ID >> records[i].x >> records[i].y;
+    }
+}
+
+bool SameRecords(const vector<Record_t>& a, const vector<Record_t>& b) {
+    if (a.size() != b.size())
+        return false;
+    for (size_t i=0; i<a.size(); ++i) {
+        if (a[i].ID!=b[i].ID || a[i].x!=b[i].x || a[i].y!=b[i].y)
+            return false;
+    }
+    return true;
+}
+
+template<typename F>
+double Milliseconds(F&& load) {
+    auto start = chrono::steady_clock::now();
+    load();
+    auto end = chrono::steady_clock::now();
+    return chrono::duration<double, milli>(end - start).count();
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        printf("Usage: %s data_file [data_file ...]\n", argv[0]);
+        return 1;
+    }
+
+    const size_t max_threads = max(1u, thread::hardware_concurrency());
+    bool all_ok = true;
+
+    for (int f=1; f<argc; ++f) {
+        vector<Record_t> expected, records;
+        double stream_time = Milliseconds([&]() { GetInputDataStream(argv[f], expected); });
+        printf("-------------- %s (%zu records) --------------\n", argv[f], expected.size());
+        printf("%-12s %10.1f [ms]\n", "iostream", stream_time);
+
+        for (size_t num_threads=1; ; num_threads=min(2*num_threads, max_threads)) {
+            double time = Milliseconds([&]() { ICDE18::GetInputData(argv[f], records, num_threads); });
+            bool ok = SameRecords(expected, records);
+            printf("threads=%-4zu %10.1f [ms], speedup = %.2f, %s\n",
+                    num_threads, time, stream_time / time, ok ? "OK" : "MISMATCH");
+            all_ok = all_ok && ok;
+            if (num_threads == max_threads)
+                break;
+        }
+    }
+    fflush(stdout);
+
+    return all_ok ? 0 : 1;
+}
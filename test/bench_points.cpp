@@ -0,0 +1,158 @@
+// Compares the range scan throughput of the array-of-structs records against
+// the structure-of-arrays PointStore, and checks that both return the same
+// records.
+//
+// Usage: ./bench_points [data_file | number_of_points] [number_of_queries]
+//
+// data_file is in the silo input format, e.g. one of the OSM datasets.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "global.h"
+#include "filter.h"
+#include "points.hpp"
+
+using namespace std;
+using ICDE18::Record_t;
+using ICDE18::Circle_t;
+using ICDE18::Rectangle_t;
+using ICDE18::PointStore;
+
+const FilterBackend backends[] = {FilterBackend::SCALAR, FilterBackend::AVX2, FilterBackend::AVX512};
+
+void LoadRecords(const char* arg, vector<Record_t>& records, mt19937& gen) {
+    char* end = NULL;
+    size_t n = strtoul(arg, &end, 10);
+    if (end != arg && *end == '\0') {
+        uniform_real_distribution<float> coord(-180.0f, 180.0f);
+        records.resize(n);
+        for (size_t i=0; i<n; ++i) {
+            records[i] = Record_t(i, coord(gen), coord(gen) * 0.5f);
+        }
+    } else {
+        ICDE18::GetInputData(arg, records);
+    }
+}
+
+// the current silo scan, one IntersectWithRange per record
+template<typename Range_t>
+void AosScan(const vector<Record_t>& records, const Range_t& range, vector<Record_t>& ans) {
+    ans.clear();
+    for (const auto& record : records) {
+        if (ICDE18::IntersectWithRange(record, range))
+            ans.emplace_back(record);
+    }
+}
+
+void SoaScan(FilterBackend backend, const PointStore& points, const Circle_t& range,
+             vector<uint32_t>& idx, vector<Record_t>& ans) {
+    ans.clear();
+    size_t m = FILTER::FilterCircle(backend, points.x_data(), points.y_data(), points.size(),
+                                    range.x, range.y, range.rad, idx.data());
+    points.materialize(0, idx.data(), m, ans);
+}
+
+void SoaScan(FilterBackend backend, const PointStore& points, const Rectangle_t& range,
+             vector<uint32_t>& idx, vector<Record_t>& ans) {
+    ans.clear();
+    size_t m = FILTER::FilterRectangle(backend, points.x_data(), points.y_data(), points.size(),
+                                       range.x, range.y, range.dx, range.dy, idx.data());
+    points.materialize(0, idx.data(), m, ans);
+}
+
+bool SameRecords(const vector<Record_t>& a, const vector<Record_t>& b) {
+    if (a.size() != b.size())
+        return false;
+    for (size_t i=0; i<a.size(); ++i) {
+        if (a[i].ID!=b[i].ID || a[i].x!=b[i].x || a[i].y!=b[i].y)
+            return false;
+    }
+    return true;
+}
+
+template<typename F>
+double PointsPerSecond(size_t n, size_t n_queries, F&& scan) {
+    auto start = chrono::steady_clock::now();
+    for (size_t q=0; q<n_queries; ++q) {
+        scan(q);
+    }
+    auto end = chrono::steady_clock::now();
+    double seconds = chrono::duration<double>(end - start).count();
+    return double(n) * n_queries / seconds;
+}
+
+int main(int argc, char** argv) {
+    mt19937 gen(2024);
+    vector<Record_t> records;
+    LoadRecords((argc > 1) ? argv[1] : "1000000", records, gen);
+    const size_t n_queries = (argc > 2) ? strtoul(argv[2], NULL, 10) : 64;
+    const size_t n = records.size();
+    if (n == 0) {
+        printf("no records\n");
+        return 1;
+    }
+
+    PointStore points(records);
+
+    // queries centered on data points, with a radius covering about 1% of the data
+    uniform_int_distribution<size_t> pick(0, n-1);
+    float min_x = records[0].x, max_x = records[0].x;
+    for (const auto& record : records) {
+        min_x = min(min_x, record.x);
+        max_x = max(max_x, record.x);
+    }
+    const float rad = max((max_x - min_x) * 0.05f, 1e-3f);
+    vector<Circle_t> circs(n_queries);
+    vector<Rectangle_t> rects(n_queries);
+    for (size_t q=0; q<n_queries; ++q) {
+        const Record_t& center = records[pick(gen)];
+        circs[q] = Circle_t(ICDE18::QueryType_t::RANGE_QUERY, center.x, center.y, rad);
+        rects[q].x = center.x;
+        rects[q].y = center.y;
+        rects[q].dx = rects[q].dy = rad;
+    }
+
+    printf("-------------- Point Store Check (%zu points) --------------\n", n);
+    printf("AoS = %.2f [MB], SoA = %.2f [MB]\n",
+            n * sizeof(Record_t) / 1024.0 / 1024.0, points.memory_size() / 1024.0 / 1024.0);
+    vector<uint32_t> idx(n);
+    vector<Record_t> expected, ans;
+    bool all_ok = true;
+    for (auto backend : backends) {
+        if (!FILTER::IsSupported(backend))
+            continue;
+        bool ok = true;
+        for (size_t q=0; q<n_queries; ++q) {
+            AosScan(records, circs[q], expected);
+            SoaScan(backend, points, circs[q], idx, ans);
+            ok = ok && SameRecords(expected, ans);
+            AosScan(records, rects[q], expected);
+            SoaScan(backend, points, rects[q], idx, ans);
+            ok = ok && SameRecords(expected, ans);
+        }
+        printf("soa-%-8s %s\n", FILTER::BackendName(backend), ok ? "OK" : "MISMATCH");
+        all_ok = all_ok && ok;
+    }
+
+    printf("-------------- Point Store Benchmark (%zu queries) --------------\n", n_queries);
+    double circ = PointsPerSecond(n, n_queries, [&](size_t q) { AosScan(records, circs[q], ans); });
+    double rect = PointsPerSecond(n, n_queries, [&](size_t q) { AosScan(records, rects[q], ans); });
+    printf("%-12s circle = %.3e [points/s], rectangle = %.3e [points/s]\n", "aos", circ, rect);
+    for (auto backend : backends) {
+        if (!FILTER::IsSupported(backend))
+            continue;
+        circ = PointsPerSecond(n, n_queries, [&](size_t q) { SoaScan(backend, points, circs[q], idx, ans); });
+        rect = PointsPerSecond(n, n_queries, [&](size_t q) { SoaScan(backend, points, rects[q], idx, ans); });
+        printf("soa-%-8s circle = %.3e [points/s], rectangle = %.3e [points/s]\n",
+                FILTER::BackendName(backend), circ, rect);
+    }
+    fflush(stdout);
+
+    return all_ok ? 0 : 1;
+}
@@ -0,0 +1,137 @@
+// Checks every AES backend against the reference implementation and
+// reports the ECB throughput of each one in blocks/sec.
+//
+// Usage: ./test_aes [number_of_blocks]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "AES.h"
+
+using namespace std;
+
+const AESBackend backends[] = {AESBackend::REFERENCE, AESBackend::TTABLE, AESBackend::AESNI};
+const AESKeyLength keyLengths[] = {AESKeyLength::AES_128, AESKeyLength::AES_192, AESKeyLength::AES_256};
+
+size_t KeyBytes(AESKeyLength keyLength) {
+    if (keyLength == AESKeyLength::AES_128) return 16;
+    if (keyLength == AESKeyLength::AES_192) return 24;
+    return 32;
+}
+
+vector<unsigned char> RandomBytes(mt19937& gen, size_t n) {
+    vector<unsigned char> ret(n);
+    for (auto& c : ret) c = gen() & 0xff;
+    return ret;
+}
+
+// FIPS-197 Appendix C
+bool CheckKnownAnswer(AESBackend backend) {
+    const unsigned char plain[16] = {0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
+                                     0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff};
+    const unsigned char expected[3][16] = {
+        {0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b, 0x04, 0x30, 0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a},
+        {0xdd, 0xa9, 0x7c, 0xa4, 0x86, 0x4c, 0xdf, 0xe0, 0x6e, 0xaf, 0x70, 0xa0, 0xec, 0x0d, 0x71, 0x91},
+        {0x8e, 0xa2, 0xb7, 0xca, 0x51, 0x67, 0x45, 0xbf, 0xea, 0xfc, 0x49, 0x90, 0x4b, 0x49, 0x60, 0x89}};
+    bool ok = true;
+
+    for (int k=0; k<3; ++k) {
+        vector<unsigned char> key(KeyBytes(keyLengths[k]));
+        for (size_t i=0; i<key.size(); ++i) key[i] = i;
+
+        AES aes(keyLengths[k]);
+        aes.SetBackend(backend);
+        aes.SetKey(key);
+
+        unsigned char cipher[16], back[16];
+        aes.EncryptBlocks(plain, 16, cipher);
+        aes.DecryptBlocks(cipher, 16, back);
+        ok = ok && memcmp(cipher, expected[k], 16)==0 && memcmp(back, plain, 16)==0;
+    }
+
+    return ok;
+}
+
+// random keys and lengths, including the legacy ECB/CBC/CFB API
+bool CheckAgainstReference(AESBackend backend, mt19937& gen) {
+    bool ok = true;
+
+    for (auto keyLength : keyLengths) {
+        for (int trial=0; trial<50; ++trial) {
+            vector<unsigned char> key = RandomBytes(gen, KeyBytes(keyLength));
+            vector<unsigned char> iv = RandomBytes(gen, 16);
+            vector<unsigned char> plain = RandomBytes(gen, 16 * (1 + gen()%37));
+
+            AES ref(keyLength), aes(keyLength);
+            ref.SetBackend(AESBackend::REFERENCE);
+            aes.SetBackend(backend);
+
+            ok = ok && aes.EncryptECB(plain, key) == ref.EncryptECB(plain, key);
+            ok = ok && aes.DecryptECB(plain, key) == ref.DecryptECB(plain, key);
+            ok = ok && aes.EncryptCBC(plain, key, iv) == ref.EncryptCBC(plain, key, iv);
+            ok = ok && aes.DecryptCBC(plain, key, iv) == ref.DecryptCBC(plain, key, iv);
+            ok = ok && aes.EncryptCFB(plain, key, iv) == ref.EncryptCFB(plain, key, iv);
+            ok = ok && aes.DecryptCFB(plain, key, iv) == ref.DecryptCFB(plain, key, iv);
+
+            vector<unsigned char> cipher(plain.size()), back(plain.size());
+            aes.SetKey(key);
+            aes.EncryptBlocks(plain.data(), plain.size(), cipher.data());
+            aes.DecryptBlocks(cipher.data(), cipher.size(), back.data());
+            ok = ok && cipher == ref.EncryptECB(plain, key) && back == plain;
+        }
+    }
+
+    return ok;
+}
+
+double BlocksPerSecond(AES& aes, bool encrypt, const vector<unsigned char>& in, vector<unsigned char>& out) {
+    const int rounds = 3;
+    auto start = chrono::steady_clock::now();
+    for (int r=0; r<rounds; ++r) {
+        if (encrypt)
+            aes.EncryptBlocks(in.data(), in.size(), out.data());
+        else
+            aes.DecryptBlocks(in.data(), in.size(), out.data());
+    }
+    auto end = chrono::steady_clock::now();
+    double seconds = chrono::duration<double>(end - start).count();
+    return (in.size() / 16.0) * rounds / seconds;
+}
+
+int main(int argc, char** argv) {
+    const size_t n_blocks = (argc > 1) ? strtoul(argv[1], NULL, 10) : (1 << 20);
+    mt19937 gen(2024);
+    bool all_ok = true;
+
+    printf("-------------- AES Backend Check --------------\n");
+    for (auto backend : backends) {
+        if (!AESBACKEND::IsSupported(backend)) {
+            printf("%-10s not supported on this cpu\n", AESBACKEND::BackendName(backend));
+            continue;
+        }
+        bool ok = CheckKnownAnswer(backend) && CheckAgainstReference(backend, gen);
+        printf("%-10s %s\n", AESBACKEND::BackendName(backend), ok ? "OK" : "MISMATCH");
+        all_ok = all_ok && ok;
+    }
+
+    printf("-------------- AES Backend Benchmark (%zu blocks, AES-256 ECB) --------------\n", n_blocks);
+    vector<unsigned char> key = RandomBytes(gen, 32);
+    vector<unsigned char> in = RandomBytes(gen, 16 * n_blocks), out(in.size());
+    for (auto backend : backends) {
+        if (!AESBACKEND::IsSupported(backend))
+            continue;
+        AES aes(AESKeyLength::AES_256);
+        aes.SetBackend(backend);
+        aes.SetKey(key);
+        double enc = BlocksPerSecond(aes, true, in, out);
+        double dec = BlocksPerSecond(aes, false, in, out);
+        printf("%-10s encrypt = %.3e [blocks/s], decrypt = %.3e [blocks/s]\n",
+                AESBACKEND::BackendName(backend), enc, dec);
+    }
+    fflush(stdout);
+
+    return all_ok ? 0 : 1;
+}